@@ -44,10 +44,12 @@ std::string Common::getDestination(const RecordPtr& record,
   if (record->getName() == source)
     return record->getOnion();
 
-  NameList list = record->getSubdomains();
-  for (auto subdomain : list)
-    if (subdomain.first + "." + record->getName() == source)
-      return subdomain.second;
+  for (size_t j = 0; j < record->getSubdomainCount(); j++)
+  {
+    const auto& subdomain = record->getSubdomain(j);
+    if (subdomain.first.str() + "." + record->getName() == source)
+      return subdomain.second.str();
+  }
 
   Log::get().error("Record does not contain \"" + source + "\"!");
   return "";
@@ -76,6 +76,20 @@ bool Utils::isPowerOfTwo(std::size_t x)
 
 
 
+uint64_t Utils::fnv1a(const std::string& str)
+{  // http://www.isthe.com/chongo/tech/comp/fnv/
+  uint64_t hash = 14695981039346656037ULL;
+  for (char c : str)
+  {
+    hash ^= static_cast<uint8_t>(c);
+    hash *= 1099511628211ULL;
+  }
+
+  return hash;
+}
+
+
+
 unsigned long Utils::decode64Estimation(unsigned long inSize)
 {  // https://stackoverflow.com/questions/1533113/calculate-the-size-to-a-base-64-encoded-message
   return ((inSize * 4) / 3) + (inSize / 96) + 6;
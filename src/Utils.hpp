@@ -14,6 +14,7 @@ class Utils
   static uint32_t arrayToUInt32(const uint8_t*, int32_t);
   static char* getAsHex(const uint8_t*, int);
   static bool isPowerOfTwo(std::size_t);
+  static uint64_t fnv1a(const std::string&);
 
   static unsigned long decode64Estimation(unsigned long);
 
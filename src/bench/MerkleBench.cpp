@@ -0,0 +1,336 @@
+
+// Builds Merkle trees of synthetic Records at each power of ten in a range and
+// prints one JSON object per line for each size: build and map times, memory,
+// the time and memory of building the smaller trees in memory from Records,
+// file size, proof generation latency and size for present and absent names,
+// and verification time. Lines from different runs can be diffed or loaded
+// side by side, so changes to the trees can be judged by their numbers.
+
+#include "../containers/MerkleBuilder.hpp"
+#include "../containers/MerkleProof.hpp"
+#include "../containers/records/CreateR.hpp"
+#include "../Log.hpp"
+#include "../Utils.hpp"
+#include <botan/auto_rng.h>
+#include <botan/rsa.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <iostream>
+#include <cstdio>
+#include <chrono>
+#include <random>
+#include <memory>
+
+
+typedef std::chrono::steady_clock Clock;
+
+
+// leaves take the even numbers, so the odd ones between them are absent
+std::string getName(uint64_t n)
+{
+  char name[32];
+  snprintf(name, sizeof(name), "bench%012llu.tor",
+           static_cast<unsigned long long>(n));
+  return name;
+}
+
+
+
+// Records share the key, which they do not own, so any of them can be made
+// again from its name alone, as a mapped tree's source of Records must
+RecordPtr makeRecord(const std::string& name, Botan::RSA_PublicKey* key)
+{
+  return std::make_shared<CreateR>("", name, NameList(), "", "", "", key);
+}
+
+
+
+double getMillis(const Clock::time_point& start)
+{
+  return std::chrono::duration<double, std::milli>(Clock::now() - start)
+      .count();
+}
+
+
+
+// resident set size in bytes, from /proc
+uint64_t getResident()
+{
+  unsigned long long pages = 0, resident = 0;
+  FILE* statm = fopen("/proc/self/statm", "r");
+  if (statm)
+  {
+    if (fscanf(statm, "%llu %llu", &pages, &resident) != 2)
+      resident = 0;
+    fclose(statm);
+  }
+
+  return resident * static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+}
+
+
+
+// the change since the earlier reading, which may be negative once memory
+// is returned to the system
+Json::Int64 getResidentSince(uint64_t before)
+{
+  return static_cast<Json::Int64>(getResident()) -
+         static_cast<Json::Int64>(before);
+}
+
+
+
+uint64_t getPeakResident()
+{
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return static_cast<uint64_t>(usage.ru_maxrss) * 1024;
+}
+
+
+
+// the median, 99th percentile, and mean of the samples, in microseconds
+Json::Value summarize(std::vector<double> samples)
+{
+  Json::Value result;
+  if (samples.empty())
+    return result;
+
+  std::sort(samples.begin(), samples.end());
+  double total = 0;
+  for (auto sample : samples)
+    total += sample;
+
+  result["p50"] = samples[samples.size() / 2];
+  result["p99"] = samples[std::min(samples.size() - 1,
+                                   samples.size() * 99 / 100)];
+  result["mean"] = total / static_cast<double>(samples.size());
+  return result;
+}
+
+
+
+// generates and verifies proofs of the names, recording each latency and size
+Json::Value measureProofs(const MerkleTree& tree,
+                          const std::vector<uint64_t>& names,
+                          bool present,
+                          Botan::RSA_PublicKey* key,
+                          size_t& failures)
+{
+  Json::FastWriter writer;
+  std::vector<double> jsonTimes, binaryTimes, verifyTimes, jsonVerifyTimes;
+  uint64_t jsonBytes = 0, binaryBytes = 0;
+  SHA384_HASH root = tree.getRootHash();
+
+  for (auto n : names)
+  {
+    std::string name = getName(n);
+    RecordPtr record = makeRecord(name, key);
+
+    auto start = Clock::now();
+    Json::Value subtree = tree.generateSubtree(name);
+    jsonTimes.push_back(getMillis(start) * 1000);
+    jsonBytes += writer.write(subtree).size();
+
+    start = Clock::now();
+    std::string proof = tree.generateProof(name);
+    binaryTimes.push_back(getMillis(start) * 1000);
+    binaryBytes += proof.size();
+
+    start = Clock::now();
+    MerkleProof typed(proof);
+    bool valid = typed.getRoot() == root &&
+                 (present ? typed.doesContain(record)
+                          : typed.doesExclude(name));
+    verifyTimes.push_back(getMillis(start) * 1000);
+
+    start = Clock::now();
+    valid &= (present ? MerkleTree::doesContain(subtree, record)
+                      : MerkleTree::doesExclude(subtree, name)) &&
+             MerkleTree::extractRoot(subtree) == root;
+    jsonVerifyTimes.push_back(getMillis(start) * 1000);
+
+    if (!valid)
+      failures++;
+  }
+
+  double count = std::max<double>(1, static_cast<double>(names.size()));
+  Json::Value result;
+  result["generate_json_us"] = summarize(jsonTimes);
+  result["generate_binary_us"] = summarize(binaryTimes);
+  result["verify_us"] = summarize(verifyTimes);
+  result["verify_json_us"] = summarize(jsonVerifyTimes);
+  result["json_bytes"] = static_cast<double>(jsonBytes) / count;
+  result["binary_bytes"] = static_cast<double>(binaryBytes) / count;
+  return result;
+}
+
+
+
+// builds the tree in memory from Records, as the resolver does, and checks
+// its root against one streamed from the same Records; the Records are made
+// first, so the time and memory are the tree's alone, though the time
+// includes serializing each Record for its hash
+void measureMemoryTree(uint64_t size,
+                       Botan::RSA_PublicKey* key,
+                       Json::Value& result,
+                       size_t& failures)
+{
+  std::vector<RecordPtr> records;
+  records.reserve(size);
+  for (uint64_t j = 0; j < size; j++)
+    records.push_back(makeRecord(getName(2 * j), key));
+
+  MerkleBuilder builder;
+  for (auto r : records)
+    builder.add(r);
+  SHA384_HASH root = builder.finish();
+
+  uint64_t residentBefore = getResident();
+  auto start = Clock::now();
+  MerkleTree tree(records);
+  result["build_memory_ms"] = getMillis(start);
+  result["memory_resident_bytes"] = getResidentSince(residentBefore);
+
+  if (tree.getRootHash() != root)
+    failures++;
+}
+
+
+
+// builds, maps, and proves against a tree of the given size, and builds it in
+// memory too if asked; the streamed builds make each Record as they go, so
+// their times include serializing it for its hash
+Json::Value measureTree(uint64_t size,
+                        size_t samples,
+                        const std::string& directory,
+                        Botan::RSA_PublicKey* key,
+                        bool inMemory,
+                        std::mt19937_64& rng)
+{
+  Json::Value result;
+  result["leaves"] = static_cast<Json::UInt64>(size);
+  size_t failures = 0;
+  if (inMemory)
+    measureMemoryTree(size, key, result, failures);
+
+  // root only, holding one pending node per level
+  auto start = Clock::now();
+  MerkleBuilder builder;
+  for (uint64_t j = 0; j < size; j++)
+    builder.add(makeRecord(getName(2 * j), key));
+  builder.finish();
+  result["build_ms"] = getMillis(start);
+
+  std::string path = directory + "/merkle-bench-" + std::to_string(size);
+  start = Clock::now();
+  MerkleBuilder fileBuilder(path);
+  for (uint64_t j = 0; j < size; j++)
+    fileBuilder.add(makeRecord(getName(2 * j), key));
+  fileBuilder.finish();
+  result["build_file_ms"] = getMillis(start);
+
+  struct stat info;
+  if (stat(path.c_str(), &info) == 0)
+    result["file_bytes"] = static_cast<Json::UInt64>(info.st_size);
+
+  uint64_t residentBefore = getResident();
+  {
+    start = Clock::now();
+    MerkleTree tree(path, size);
+    result["map_ms"] = getMillis(start);
+    tree.setProofCacheSize(0);  // measure generation, not the cache
+    tree.setRecordSource([key](const std::string& name)
+                         {
+                           return makeRecord(name, key);
+                         });
+
+    std::uniform_int_distribution<uint64_t> pick(0, size - 1);
+    std::vector<uint64_t> present, absent;
+    for (size_t j = 0; j < samples; j++)
+    {
+      uint64_t index = pick(rng);
+      present.push_back(2 * index);
+      absent.push_back(2 * index + 1);
+    }
+
+    result["present"] = measureProofs(tree, present, true, key, failures);
+    result["absent"] = measureProofs(tree, absent, false, key, failures);
+    result["resident_bytes"] = getResidentSince(residentBefore);
+  }
+
+  std::remove(path.c_str());
+  result["peak_resident_bytes"] = static_cast<Json::UInt64>(getPeakResident());
+  result["failures"] = static_cast<Json::UInt64>(failures);
+  return result;
+}
+
+
+
+int main(int argc, char** argv)
+{
+  int minExponent = 3, maxExponent = 7, memoryExponent = 6, samples = 1000;
+  int seed = 1;
+  char* directory = nullptr;
+  char* logPath = nullptr;
+
+  struct poptOption po[] = {
+      {"min", 'm', POPT_ARG_INT, &minExponent, 0,
+       "Smallest tree, as a power of ten.", "3"},
+      {"max", 'M', POPT_ARG_INT, &maxExponent, 0,
+       "Largest tree, as a power of ten.", "7"},
+      {"memory-max", 0, POPT_ARG_INT, &memoryExponent, 0,
+       "Largest tree also built in memory from Records, as a power of ten.",
+       "6"},
+      {"samples", 's', POPT_ARG_INT, &samples, 0,
+       "Present and absent names to prove at each size.", "1000"},
+      {"seed", 0, POPT_ARG_INT, &seed, 0, "Seed for choosing names.", "1"},
+      {"dir", 'd', POPT_ARG_STRING, &directory, 0,
+       "Directory for the temporary tree files.", "."},
+      {"log", 'l', POPT_ARG_STRING, &logPath, 0,
+       "Log file, so that only results are printed.", "/dev/null"},
+      POPT_AUTOHELP POPT_TABLEEND};
+
+  poptContext pc = poptGetContext(NULL, argc, const_cast<const char**>(argv),
+                                  po, 0);
+  if (!Utils::parse(pc))
+    return EXIT_FAILURE;
+
+  if (minExponent < 0 || maxExponent > 9 || minExponent > maxExponent ||
+      samples <= 0)
+  {
+    std::cerr << "Invalid range of sizes or number of samples." << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  // the log announces itself on stdout as it opens, so open it while stdout
+  // is silenced to leave only the results there
+  Log::setLogPath(logPath ? logPath : "/dev/null");
+  std::streambuf* stdoutBuffer = std::cout.rdbuf(nullptr);
+  Log::get();
+  std::cout.rdbuf(stdoutBuffer);
+
+  // every Record shares one key, see makeRecord
+  Botan::AutoSeeded_RNG keyRNG;
+  Botan::RSA_PrivateKey key(keyRNG, 1024);
+
+  std::mt19937_64 rng(static_cast<uint64_t>(seed));
+  Json::FastWriter writer;
+
+  uint64_t size = 1;
+  for (int j = 0; j < minExponent; j++)
+    size *= 10;
+  for (int exponent = minExponent; exponent <= maxExponent;
+       exponent++, size *= 10)
+  {
+    Json::Value result =
+        measureTree(size, static_cast<size_t>(samples),
+                    directory ? directory : ".", &key,
+                    exponent <= memoryExponent, rng);
+    std::cout << writer.write(result) << std::flush;  // one line per size
+  }
+
+  return EXIT_SUCCESS;
+}
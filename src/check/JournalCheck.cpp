@@ -0,0 +1,266 @@
+
+// Exercises the Cache's recovery paths on temporary files and exits with
+// failure if any step disagrees: a torn or corrupt journal tail is cut off
+// and later appends follow the intact entries, a journal left behind by an
+// interrupted compaction is replayed and folded into the snapshot, a
+// compaction after evictions keeps every Record, and a failed append leaves
+// neither memory nor the journal holding the batch.
+
+#include "../containers/Cache.hpp"
+#include "../containers/Journal.hpp"
+#include "../containers/records/CreateR.hpp"
+#include "../Log.hpp"
+#include "../Utils.hpp"
+#include <botan/auto_rng.h>
+#include <botan/rsa.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <iostream>
+#include <fstream>
+#include <csignal>
+#include <cstdio>
+#include <thread>
+
+
+size_t failures = 0;
+
+
+
+void expect(bool condition, const std::string& what)
+{
+  std::cout << (condition ? "ok     " : "FAILED ") << what << std::endl;
+  if (!condition)
+    failures++;
+}
+
+
+
+// valid, signed Records, as replay and snapshots accept nothing else
+std::vector<RecordPtr> makeRecords(const std::string& prefix,
+                                   size_t count,
+                                   Botan::RSA_PrivateKey* key)
+{
+  auto nWorkers = std::max(1u, std::thread::hardware_concurrency());
+
+  std::vector<RecordPtr> records;
+  for (size_t n = 0; n < count; n++)
+  {
+    auto record = std::make_shared<CreateR>(
+        key, prefix + std::to_string(n) + ".tor", "");
+    record->makeValid(static_cast<uint8_t>(std::min(nWorkers, 255u)));
+    records.push_back(record);
+  }
+
+  return records;
+}
+
+
+
+off_t getFileSize(const std::string& path)
+{
+  struct stat info;
+  return stat(path.c_str(), &info) == 0 ? info.st_size : -1;
+}
+
+
+
+// tests whether the snapshot holds exactly the expected number of Records,
+// in order and without repeats
+bool isComplete(const std::string& path, size_t expected)
+{
+  size_t count = 0;
+  bool ordered = true;
+  std::string last;
+  Journal::scanSnapshot(path, [&](const RecordPtr& record)
+                        {
+                          ordered &= last < record->getName();
+                          last = record->getName();
+                          count++;
+                        });
+
+  return ordered && count == expected;
+}
+
+
+
+void checkTornTail(const std::string& path,
+                   const std::vector<RecordPtr>& records)
+{
+  {
+    Journal journal(path);
+    journal.append(records);
+  }
+  off_t intact = getFileSize(path);
+
+  // a header promising more bytes than follow, as a crash mid-write leaves
+  {
+    std::ofstream file(path, std::ofstream::app | std::ofstream::binary);
+    file.write("\x00\x00\x03\xe8\x01\x02\x03\x04{\"na", 12);
+  }
+  auto replayed = Journal::replay(path);
+  expect(replayed.size() == records.size() && getFileSize(path) == intact,
+         "torn tail is cut off");
+
+  // a flipped byte in the last entry fails its checksum
+  {
+    std::fstream file(path, std::fstream::in | std::fstream::out |
+                                std::fstream::binary);
+    file.seekp(intact - 2);
+    file.put('#');
+  }
+  replayed = Journal::replay(path);
+  expect(replayed.size() + 1 == records.size() && getFileSize(path) < intact,
+         "corrupt last entry is cut off");
+
+  {
+    Journal journal(path);
+    journal.append({records.back()});
+  }
+  replayed = Journal::replay(path);
+  expect(replayed.size() == records.size() &&
+             replayed.back()->getName() == records.back()->getName(),
+         "appends follow the intact entries");
+
+  std::remove(path.c_str());
+}
+
+
+
+// a snapshot, a rotated journal that compaction did not get to remove, and
+// the current journal, as an interrupted compaction leaves them
+void checkLeftoverJournal(const std::string& snapshotPath,
+                          const std::string& journalPath,
+                          const std::vector<RecordPtr>& snapshotted,
+                          const std::vector<RecordPtr>& rotated,
+                          const std::vector<RecordPtr>& journaled)
+{
+  Journal::writeSnapshot(snapshotPath, snapshotted);
+  Journal(journalPath + ".old").append(rotated);
+  Journal(journalPath).append(journaled);
+
+  size_t total = snapshotted.size() + rotated.size() + journaled.size();
+  Cache::openJournal(snapshotPath, journalPath);
+  expect(Cache::getRecordCount() == total, "leftover journal is replayed");
+  expect(getFileSize(journalPath + ".old") < 0 &&
+             isComplete(snapshotPath, total) &&
+             Journal::replay(journalPath).empty(),
+         "leftover journal is folded into the snapshot");
+}
+
+
+
+// once Records are evicted, compaction must merge the old snapshot and the
+// journal rather than write out only the resident Records
+void checkEvictedCompaction(const std::string& snapshotPath,
+                            const std::vector<RecordPtr>& added)
+{
+  size_t total = Cache::getRecordCount() + added.size();
+  Cache::setMemoryBudget(1);  // evicts all that it can
+  Cache::add(added);
+  expect(Cache::getStats()["evictions"].asUInt64() > 0 &&
+             Cache::getRecordCount() < total,
+         "Records are evicted");
+
+  Cache::compact();
+  expect(isComplete(snapshotPath, total),
+         "compaction keeps the evicted Records");
+  Cache::setMemoryBudget(0);
+}
+
+
+
+// caps the file size so that the journal's write fails partway through the
+// batch, which must then be neither resident nor logged
+void checkFailedAppend(const std::string& journalPath,
+                       const std::vector<RecordPtr>& batch)
+{
+  size_t resident = Cache::getRecordCount();
+  off_t size = getFileSize(journalPath);
+
+  signal(SIGXFSZ, SIG_IGN);  // so that the write fails instead
+  struct rlimit limit;
+  getrlimit(RLIMIT_FSIZE, &limit);
+  rlim_t previous = limit.rlim_cur;
+  limit.rlim_cur = static_cast<rlim_t>(size) + 64;
+  setrlimit(RLIMIT_FSIZE, &limit);
+
+  bool threw = false;
+  try
+  {
+    Cache::add(batch);
+  }
+  catch (const std::runtime_error&)
+  {
+    threw = true;
+  }
+
+  limit.rlim_cur = previous;
+  setrlimit(RLIMIT_FSIZE, &limit);
+
+  expect(threw, "failed append is reported");
+  expect(Cache::getRecordCount() == resident &&
+             !Cache::get(batch.front()->getName()),
+         "failed batch is not resident");
+  expect(getFileSize(journalPath) == size, "failed batch is not logged");
+}
+
+
+
+int main(int argc, char** argv)
+{
+  int count = 8;
+  char* directory = nullptr;
+  char* logPath = nullptr;
+
+  struct poptOption po[] = {
+      {"records", 'r', POPT_ARG_INT, &count, 0,
+       "Records in each set, each needing its proof-of-work.", "8"},
+      {"dir", 'd', POPT_ARG_STRING, &directory, 0,
+       "Directory for the temporary journal and snapshot.", "."},
+      {"log", 'l', POPT_ARG_STRING, &logPath, 0,
+       "Log file, so that only results are printed.", "/dev/null"},
+      POPT_AUTOHELP POPT_TABLEEND};
+
+  poptContext pc = poptGetContext(NULL, argc, const_cast<const char**>(argv),
+                                  po, 0);
+  if (!Utils::parse(pc))
+    return EXIT_FAILURE;
+
+  if (count < 2)
+  {
+    std::cerr << "Each set needs at least two Records." << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  // as in onions-merkle-bench, the log is opened while stdout is silenced
+  Log::setLogPath(logPath ? logPath : "/dev/null");
+  std::streambuf* stdoutBuffer = std::cout.rdbuf(nullptr);
+  Log::get();
+  std::cout.rdbuf(stdoutBuffer);
+
+  std::string prefix = std::string(directory ? directory : ".") +
+                       "/journal-check";
+  std::string snapshotPath = prefix + ".snapshot";
+  std::string journalPath = prefix + ".journal";
+  for (auto path : {snapshotPath, journalPath, journalPath + ".old"})
+    std::remove(path.c_str());
+
+  // the Records share the key, which they do not own
+  Botan::AutoSeeded_RNG rng;
+  Botan::RSA_PrivateKey key(rng, 1024);
+  size_t n = static_cast<size_t>(count);
+
+  checkTornTail(journalPath, makeRecords("torn", n, &key));
+  checkLeftoverJournal(snapshotPath, journalPath,
+                       makeRecords("snapshotted", n, &key),
+                       makeRecords("rotated", n, &key),
+                       makeRecords("journaled", n, &key));
+  checkEvictedCompaction(snapshotPath, makeRecords("evicted", n, &key));
+  checkFailedAppend(journalPath, makeRecords("refused", n, &key));
+
+  Cache::closeJournal();
+  for (auto path : {snapshotPath, journalPath, journalPath + ".old"})
+    std::remove(path.c_str());
+
+  return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
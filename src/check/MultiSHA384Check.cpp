@@ -0,0 +1,155 @@
+
+// Compares MultiSHA384 against Botan's SHA-384 over random inputs and exits
+// with failure on any mismatch: rows of random 96-byte pairs through
+// hashRow(), whose four-lane AVX2 path is taken where the CPU supports it and
+// whose scalar path hashes the remainder, single pairs through hash(), and
+// short messages of every length up to a few blocks.
+
+#include "../crypto/MultiSHA384.hpp"
+#include "../Utils.hpp"
+#include <botan/sha2_64.h>
+#include <iostream>
+#include <cstring>
+#include <random>
+#include <vector>
+
+
+SHA384_HASH getReference(const uint8_t* message, size_t length)
+{
+  Botan::SHA_384 sha;
+  auto digest = sha.process(message, length);
+
+  SHA384_HASH hash;
+  memcpy(hash.data(), digest.data(), Const::SHA384_LEN);
+  return hash;
+}
+
+
+
+SHA384_HASH getReference(const SHA384_HASH& left, const SHA384_HASH& right)
+{
+  uint8_t message[2 * Const::SHA384_LEN];
+  memcpy(message, left.data(), Const::SHA384_LEN);
+  memcpy(message + Const::SHA384_LEN, right.data(), Const::SHA384_LEN);
+  return getReference(message, sizeof(message));
+}
+
+
+
+void randomize(uint8_t* bytes, size_t length, std::mt19937_64& rng)
+{
+  for (size_t j = 0; j < length; j++)
+    bytes[j] = static_cast<uint8_t>(rng());
+}
+
+
+
+// hashes rows of odd and even sizes, so the last hash is sometimes paired
+// with itself, and starts some ranges off the lane boundary
+size_t checkRows(size_t count, std::mt19937_64& rng)
+{
+  size_t failures = 0;
+  for (size_t rowSize = 1; rowSize <= count; rowSize = rowSize * 2 + 1)
+  {
+    std::vector<SHA384_HASH> row(rowSize);
+    for (auto& hash : row)
+      randomize(hash.data(), hash.size(), rng);
+
+    size_t outSize = (rowSize + 1) / 2;
+    for (size_t begin : {size_t(0), std::min<size_t>(1, outSize)})
+    {
+      std::vector<SHA384_HASH> out(outSize);
+      MultiSHA384::hashRow(row.data(), rowSize, out.data(), begin, outSize);
+
+      for (size_t j = begin; j < outSize; j++)
+      {
+        auto& right = row[std::min(2 * j + 1, rowSize - 1)];
+        if (out[j] != getReference(row[2 * j], right))
+        {
+          std::cout << "hashRow mismatch at " << j << " of a row of "
+                    << rowSize << " from " << begin << std::endl;
+          failures++;
+        }
+      }
+    }
+  }
+
+  return failures;
+}
+
+
+
+size_t checkPairs(size_t count, std::mt19937_64& rng)
+{
+  size_t failures = 0;
+  SHA384_HASH left, right;
+  for (size_t j = 0; j < count; j++)
+  {
+    randomize(left.data(), left.size(), rng);
+    randomize(right.data(), right.size(), rng);
+    if (MultiSHA384::hash(left, right) != getReference(left, right))
+    {
+      std::cout << "hash mismatch on pair " << j << std::endl;
+      failures++;
+    }
+  }
+
+  return failures;
+}
+
+
+
+// every length crosses the padding boundaries of one, two, and three blocks
+size_t checkMessages(std::mt19937_64& rng)
+{
+  size_t failures = 0;
+  std::vector<uint8_t> message(3 * 128 + 1);
+  for (size_t length = 0; length <= message.size(); length++)
+  {
+    randomize(message.data(), length, rng);
+    if (MultiSHA384::hash(message.data(), length) !=
+        getReference(message.data(), length))
+    {
+      std::cout << "hash mismatch on a message of " << length << " bytes"
+                << std::endl;
+      failures++;
+    }
+  }
+
+  return failures;
+}
+
+
+
+int main(int argc, char** argv)
+{
+  int count = 100000, seed = 1;
+
+  struct poptOption po[] = {
+      {"count", 'c', POPT_ARG_INT, &count, 0,
+       "Random pairs to hash, and the largest row.", "100000"},
+      {"seed", 0, POPT_ARG_INT, &seed, 0, "Seed for the random inputs.", "1"},
+      POPT_AUTOHELP POPT_TABLEEND};
+
+  poptContext pc = poptGetContext(NULL, argc, const_cast<const char**>(argv),
+                                  po, 0);
+  if (!Utils::parse(pc))
+    return EXIT_FAILURE;
+
+  if (count <= 0)
+  {
+    std::cerr << "Invalid number of pairs." << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  std::mt19937_64 rng(static_cast<uint64_t>(seed));
+  std::cout << "AVX2 lanes " << (MultiSHA384::isVectorized() ? "on" : "off")
+            << std::endl;
+
+  size_t failures = checkRows(static_cast<size_t>(count), rng);
+  failures += checkPairs(static_cast<size_t>(count), rng);
+  failures += checkMessages(rng);
+
+  std::cout << failures << " mismatches" << std::endl;
+  return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
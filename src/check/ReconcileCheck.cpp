@@ -0,0 +1,262 @@
+
+// Reconciles the Cache with a peer in one process, as two resolvers would
+// over the network, and exits with failure if any step disagrees: the
+// difference is estimated within a factor of four, a small difference is
+// found with a sketch sized from the estimate and exchanged until both sides
+// hold the same Records, a difference too large for the default sketch is
+// found the same way, and malformed estimators and sketches are rejected. The
+// Cache is static, so the peer is a Reconciler over its own Records.
+
+#include "../containers/Cache.hpp"
+#include "../containers/InvertibleBloomTable.hpp"
+#include "../containers/Reconciler.hpp"
+#include "../containers/records/CreateR.hpp"
+#include "../Log.hpp"
+#include "../Utils.hpp"
+#include <botan/auto_rng.h>
+#include <botan/rsa.h>
+#include <iostream>
+#include <cstdio>
+
+
+size_t failures = 0;
+
+
+
+void expect(bool condition, const std::string& what)
+{
+  std::cout << (condition ? "ok     " : "FAILED ") << what << std::endl;
+  if (!condition)
+    failures++;
+}
+
+
+
+// Records share the key, which they do not own
+RecordPtr makeRecord(const std::string& prefix,
+                     size_t n,
+                     Botan::RSA_PublicKey* key)
+{
+  char name[32];
+  snprintf(name, sizeof(name), "%s%08zu.tor", prefix.c_str(), n);
+  return std::make_shared<CreateR>("", name, NameList(), "", "", "", key);
+}
+
+
+
+// tests whether the sketch is refused by Cache::reconcile
+bool isRejected(const Json::Value& sketch)
+{
+  std::vector<RecordPtr> onlyHere;
+  std::vector<uint64_t> onlyThere;
+  try
+  {
+    Cache::reconcile(sketch, onlyHere, onlyThere);
+  }
+  catch (const std::runtime_error&)
+  {
+    return true;
+  }
+
+  return false;
+}
+
+
+
+bool isEstimatorRejected(const Json::Value& estimator)
+{
+  try
+  {
+    Cache::estimateDifference(estimator);
+  }
+  catch (const std::runtime_error&)
+  {
+    return true;
+  }
+
+  return false;
+}
+
+
+
+// the estimate only sizes the sketch, which is rounded up in steps of four
+void expectEstimate(size_t estimate, size_t difference)
+{
+  expect(estimate * 4 >= difference && estimate <= difference * 4,
+         "estimated " + std::to_string(estimate) + " for a difference of " +
+             std::to_string(difference));
+}
+
+
+
+void checkSmallDifference(size_t size,
+                          Reconciler& peer,
+                          Botan::RSA_PublicKey* key)
+{
+  size_t onlyCache = 0, onlyPeer = 0;
+  std::vector<RecordPtr> records;
+  for (size_t n = 0; n < size; n++)
+  {
+    auto record = makeRecord("shared", n, key);
+    bool inCache = n % 100 != 1, inPeer = n % 97 != 3;
+    if (inCache)
+      records.push_back(record);
+    if (inPeer)
+      peer.add(record);
+    if (inCache != inPeer)
+      (inCache ? onlyCache : onlyPeer)++;
+  }
+  Cache::add(records);
+
+  // the Cache sends its estimator, and the peer replies with a sketch
+  size_t estimate = peer.estimateDifference(Cache::getEstimator());
+  expectEstimate(estimate, onlyCache + onlyPeer);
+  size_t nCells = Reconciler::getCellCount(estimate);
+
+  std::vector<RecordPtr> onlyHere;
+  std::vector<uint64_t> onlyThere;
+  bool decoded =
+      Cache::reconcile(peer.getSketch(nCells), onlyHere, onlyThere);
+  expect(decoded, "small difference decodes with " + std::to_string(nCells) +
+                      " cells");
+  expect(onlyHere.size() == onlyCache && onlyThere.size() == onlyPeer,
+         "difference is " + std::to_string(onlyCache) + " and " +
+             std::to_string(onlyPeer) + " Records");
+
+  // each side sends what the other lacks
+  for (auto record : onlyHere)
+    peer.add(record);
+  Cache::add(peer.resolve(onlyThere));
+
+  expect(Cache::estimateDifference(peer.getEstimator()) == 0,
+         "no difference is estimated once exchanged");
+  onlyHere.clear();
+  onlyThere.clear();
+  decoded = Cache::reconcile(peer.getSketch(Reconciler::MIN_CELLS), onlyHere,
+                             onlyThere);
+  expect(decoded && onlyHere.empty() && onlyThere.empty(),
+         "Cache holds what the peer holds");
+
+  std::vector<RecordPtr> onlyPeerRecords;
+  std::vector<uint64_t> onlyCacheKeys;
+  decoded = peer.diff(Cache::getSketch(), onlyPeerRecords, onlyCacheKeys);
+  expect(decoded && onlyPeerRecords.empty() && onlyCacheKeys.empty(),
+         "peer holds what the Cache holds");
+  expect(Cache::getRecordCount() == peer.getSize(), "sizes agree");
+}
+
+
+
+void checkLargeDifference(size_t size, Botan::RSA_PublicKey* key)
+{
+  Reconciler stranger;
+  for (size_t n = 0; n < size; n++)
+    stranger.add(makeRecord("stranger", n, key));
+
+  std::vector<RecordPtr> onlyHere;
+  std::vector<uint64_t> onlyThere;
+  bool decoded = Cache::reconcile(stranger.getSketch(), onlyHere, onlyThere);
+  expect(!decoded, "large difference exceeds the default sketch");
+
+  size_t difference = Cache::getRecordCount() + size;
+  size_t estimate = stranger.estimateDifference(Cache::getEstimator());
+  expectEstimate(estimate, difference);
+
+  // an estimate that falls short is retried with the next size up
+  size_t nCells = Reconciler::getCellCount(estimate);
+  for (int attempt = 0; attempt < 2 && !decoded; attempt++, nCells *= 4)
+  {
+    onlyHere.clear();
+    onlyThere.clear();
+    decoded = Cache::reconcile(stranger.getSketch(nCells), onlyHere,
+                               onlyThere);
+  }
+  expect(decoded && onlyHere.size() == Cache::getRecordCount() &&
+             onlyThere.size() == size,
+         "large difference decodes with a sketch sized from the estimate");
+}
+
+
+
+void checkMalformed()
+{
+  Json::Value sketch = Cache::getSketch();
+  std::string table = sketch["table"].asString();
+  Json::Value bad;
+
+  bad = sketch;
+  bad["cells"] = Json::UInt(1) << 30;
+  expect(isRejected(bad), "oversized sketch is rejected");
+
+  bad = sketch;
+  bad["table"] = table.substr(4);
+  expect(isRejected(bad), "truncated table is rejected");
+
+  bad = sketch;
+  bad["cells"] = sketch["cells"].asUInt() + 1;
+  expect(isRejected(bad), "mismatched cell count is rejected");
+
+  bad = sketch;
+  bad["cells"] = std::to_string(sketch["cells"].asUInt());
+  expect(isRejected(bad), "non-numeric cell count is rejected");
+
+  expect(isRejected(Json::Value(5)), "non-object sketch is rejected");
+
+  // well formed, but of a size the Cache keeps no table for
+  expect(isRejected(InvertibleBloomTable(99).asJSON()),
+         "sketch of an unreconcilable size is rejected");
+
+  Json::Value estimator = Cache::getEstimator();
+  Json::Value badEstimator = estimator;
+  badEstimator.resize(estimator.size() - 1);
+  expect(isEstimatorRejected(badEstimator), "missing stratum is rejected");
+
+  badEstimator = estimator;
+  badEstimator[0] = sketch;
+  expect(isEstimatorRejected(badEstimator), "oversized stratum is rejected");
+  expect(isEstimatorRejected(sketch), "non-array estimator is rejected");
+}
+
+
+
+int main(int argc, char** argv)
+{
+  int size = 20000, large = 3000;
+  char* logPath = nullptr;
+
+  struct poptOption po[] = {
+      {"size", 's', POPT_ARG_INT, &size, 0,
+       "Records in the Cache before reconciling.", "20000"},
+      {"large", 'L', POPT_ARG_INT, &large, 0,
+       "Records of a peer sharing none of them.", "3000"},
+      {"log", 'l', POPT_ARG_STRING, &logPath, 0,
+       "Log file, so that only results are printed.", "/dev/null"},
+      POPT_AUTOHELP POPT_TABLEEND};
+
+  poptContext pc = poptGetContext(NULL, argc, const_cast<const char**>(argv),
+                                  po, 0);
+  if (!Utils::parse(pc))
+    return EXIT_FAILURE;
+
+  if (size <= 0 || large <= 0)
+  {
+    std::cerr << "Invalid number of Records." << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  // as in onions-merkle-bench, the log is opened while stdout is silenced
+  Log::setLogPath(logPath ? logPath : "/dev/null");
+  std::streambuf* stdoutBuffer = std::cout.rdbuf(nullptr);
+  Log::get();
+  std::cout.rdbuf(stdoutBuffer);
+
+  Botan::AutoSeeded_RNG rng;
+  Botan::RSA_PrivateKey key(rng, 1024);
+
+  Reconciler peer;
+  checkSmallDifference(static_cast<size_t>(size), peer, &key);
+  checkLargeDifference(static_cast<size_t>(large), &key);
+  checkMalformed();
+
+  return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
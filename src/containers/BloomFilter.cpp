@@ -0,0 +1,97 @@
+
+#include "BloomFilter.hpp"
+#include "../Utils.hpp"
+#include "../Log.hpp"
+#include <functional>
+#include <algorithm>
+#include <cmath>
+
+
+BloomFilter::BloomFilter(size_t capacity, double falsePositiveRate)
+    : capacity_(std::max<size_t>(capacity, 1)),
+      count_(0),
+      falsePositiveRate_(falsePositiveRate)
+{
+  if (falsePositiveRate <= 0 || falsePositiveRate >= 1)
+    Log::get().error("Bloom filter false-positive rate must be in (0, 1).");
+
+  // https://en.wikipedia.org/wiki/Bloom_filter#Optimal_number_of_hash_functions
+  const double ln2 = std::log(2.0);
+  double bits = -std::log(falsePositiveRate) * capacity_ / (ln2 * ln2);
+  nBits_ = std::max<uint64_t>(64, static_cast<uint64_t>(std::ceil(bits)));
+  nHashes_ = std::max<uint32_t>(
+      1, static_cast<uint32_t>(std::round(nBits_ * ln2 / capacity_)));
+  bits_.resize((nBits_ + 63) / 64, 0);
+}
+
+
+
+void BloomFilter::insert(const std::string& name)
+{
+  insert(getKey(name));
+}
+
+
+
+// inserts a name by its key, so that a caller can hold names more cheaply
+void BloomFilter::insert(const Key& key)
+{
+  for (uint32_t j = 0; j < nHashes_; j++)
+  {
+    uint64_t bit = (key.first + j * key.second) % nBits_;
+    bits_[bit / 64] |= uint64_t(1) << (bit % 64);
+  }
+
+  count_++;
+}
+
+
+
+bool BloomFilter::mayContain(const std::string& name) const
+{
+  Key key = getKey(name);
+  for (uint32_t j = 0; j < nHashes_; j++)
+  {
+    uint64_t bit = (key.first + j * key.second) % nBits_;
+    if (!(bits_[bit / 64] & (uint64_t(1) << (bit % 64))))
+      return false;
+  }
+
+  return true;
+}
+
+
+
+// double hashing: https://www.eecs.harvard.edu/~michaelm/postscripts/rsa2008.pdf
+BloomFilter::Key BloomFilter::getKey(const std::string& name)
+{
+  return Key(std::hash<std::string>()(name), Utils::fnv1a(name) | 1);
+}
+
+
+
+size_t BloomFilter::getCapacity() const
+{
+  return capacity_;
+}
+
+
+
+size_t BloomFilter::getCount() const
+{
+  return count_;
+}
+
+
+
+size_t BloomFilter::getSize() const
+{
+  return bits_.size() * sizeof(uint64_t);
+}
+
+
+
+double BloomFilter::getFalsePositiveRate() const
+{
+  return falsePositiveRate_;
+}
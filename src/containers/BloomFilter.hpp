@@ -0,0 +1,37 @@
+
+#ifndef BLOOM_FILTER_HPP
+#define BLOOM_FILTER_HPP
+
+#include <utility>
+#include <vector>
+#include <string>
+#include <cstdint>
+
+// Probabilistic set of names: mayContain() never returns false for an
+// inserted name, and returns true for other names at roughly the configured
+// false-positive rate as long as no more than the capacity has been inserted.
+class BloomFilter
+{
+ public:
+  typedef std::pair<uint64_t, uint64_t> Key;  // a name's two hashes
+
+  BloomFilter(size_t, double);
+  void insert(const std::string&);
+  void insert(const Key&);
+  bool mayContain(const std::string&) const;
+  static Key getKey(const std::string&);
+
+  size_t getCapacity() const;
+  size_t getCount() const;
+  size_t getSize() const;  // in bytes
+  double getFalsePositiveRate() const;
+
+ private:
+  std::vector<uint64_t> bits_;
+  uint64_t nBits_;
+  uint32_t nHashes_;
+  size_t capacity_, count_;
+  double falsePositiveRate_;
+};
+
+#endif
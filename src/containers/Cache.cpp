@@ -1,65 +1,919 @@
 
 #include "Cache.hpp"
+#include "../Log.hpp"
+#include "../Utils.hpp"
+#include "records/StringPool.hpp"
 #include <algorithm>
+#include <iterator>
+#include <fstream>
+#include <cstdio>
 
 std::vector<RecordPtr> Cache::records_;
+std::unordered_map<std::string, RecordPtr> Cache::index_;
+std::mutex Cache::mutex_;
+
+std::unordered_map<std::string, InternedString> Cache::destinations_;
+std::unordered_map<std::string, InternedString> Cache::links_;
+std::unordered_map<std::string, std::vector<std::string> > Cache::dependents_;
+
+std::shared_ptr<BloomFilter> Cache::filter_;
+double Cache::falsePositiveRate_ = 0.01;
+
+uint64_t Cache::lookups_ = 0;
+uint64_t Cache::primaryHits_ = 0;
+uint64_t Cache::subdomainHits_ = 0;
+uint64_t Cache::primaryMisses_ = 0;
+uint64_t Cache::subdomainMisses_ = 0;
+uint64_t Cache::filterRejects_ = 0;
+uint64_t Cache::conflicts_ = 0;
+uint64_t Cache::evictions_ = 0;
+uint64_t Cache::refetches_ = 0;
+CountMinSketch Cache::hotNames_(2048, 4, 16);
+
+Reconciler Cache::reconciler_;
+
+size_t Cache::budget_ = 0;
+size_t Cache::residentBytes_ = 0;
+size_t Cache::hand_ = 0;
+std::vector<BloomFilter::Key> Cache::evictedKeys_;
+std::unordered_set<const Record*> Cache::referenced_;
+std::unordered_set<std::string> Cache::pinned_;
+Cache::Fetcher Cache::fetcher_;
+
+std::shared_ptr<Journal> Cache::journal_;
+std::string Cache::snapshotPath_;
+std::mutex Cache::compactionMutex_;
+std::atomic<bool> Cache::compacting_(false);
+std::thread Cache::compactor_;
 
 
 bool Cache::add(const RecordPtr& record)
 {  // todo: delete Records should cause deletion/replacement, etc
-  if (get(record->getName()))
+  if (!insert(record))
     return false;  // cannot add record, name is already taken
 
-  records_.push_back(record);
+  if (journal_)
+  {
+    log({record});
+    compactIfNeeded();
+  }
+
   return true;
 }
 
 
 
 bool Cache::add(const std::vector<RecordPtr>& records)
-{  // todo: push all at once
-  bool allSucceeded = true;
-  for (auto r : records)
-    if (!add(r))
-      allSucceeded = false;
-  return allSucceeded;
+{
+  std::vector<RecordPtr> conflicts;
+  return add(records, conflicts);
+}
+
+
+
+// inserts a batch in one O(n log n) pass, reporting each rejected Record
+bool Cache::add(const std::vector<RecordPtr>& records,
+                std::vector<RecordPtr>& conflicts)
+{
+  auto accepted = insert(records, conflicts);
+  if (journal_ && !accepted.empty())
+  {  // one group commit for the whole batch
+    log(accepted);
+    compactIfNeeded();
+  }
+
+  return conflicts.empty();
 }
 
 
 
 std::vector<RecordPtr> Cache::getSortedList()
 {
-  std::sort(records_.begin(), records_.end(),
-            [](const RecordPtr& a, const RecordPtr& b)
-            {
-              return a->getName().compare(b->getName());
-            });
+  std::lock_guard<std::mutex> lock(mutex_);
   return records_;
 }
 
 
 
+// evicted names still pass the filter, so their misses go to the fetcher
 RecordPtr Cache::get(const std::string& name)
 {
-  for (auto r : records_)
+  RecordPtr record;
+  Fetcher fetcher;
   {
-    // check main name
-    if (r->getName() == name)
-      return r;
+    std::lock_guard<std::mutex> lock(mutex_);
+    record = access(name, fetcher);
+  }
+
+  if (!fetcher || !refetch(name, fetcher))
+    return record;
 
-    // check subdomain
-    NameList list = r->getSubdomains();
-    for (auto subdomain : list)
-      if (subdomain.first + "." + r->getName() == name)
-        return r;
+  std::lock_guard<std::mutex> lock(mutex_);
+  return lookup(name);
+}
+
+
+
+// returns the final .onion for the FQDN in one lookup, or an empty string if
+// it is unknown or its chain dangles or loops; counted and refetched as get()
+std::string Cache::getDestination(const std::string& name)
+{
+  Fetcher fetcher;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    access(name, fetcher);
+    auto iter = destinations_.find(name);
+    if (iter != destinations_.end())
+      return iter->second.str();
   }
 
-  return nullptr;
+  if (!fetcher || !refetch(name, fetcher))
+    return "";
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto iter = destinations_.find(name);
+  return iter == destinations_.end() ? "" : iter->second.str();
 }
 
 
 
 size_t Cache::getRecordCount()
 {
+  std::lock_guard<std::mutex> lock(mutex_);
   return records_.size();
 }
+
+
+
+// the rate is checked before the filter is dropped, so a bad one leaves both
+// the filter and the rate as they were
+void Cache::setFalsePositiveRate(double rate)
+{
+  if (!(rate > 0 && rate < 1))  // also rejects NaN
+    Log::get().error("Bloom filter false-positive rate must be in (0, 1).");
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  falsePositiveRate_ = rate;
+  filter_.reset();
+  reserveFilter(0);  // rebuild at the new rate
+}
+
+
+
+size_t Cache::getFilterSize()
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  return filter_ ? filter_->getSize() : 0;
+}
+
+
+
+Json::Value Cache::getStats()
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  Json::Value stats;
+
+  stats["records"] = Json::UInt64(records_.size());
+  stats["names"] = Json::UInt64(index_.size());
+  stats["lookups"] = Json::UInt64(lookups_);
+  stats["hits"]["primary"] = Json::UInt64(primaryHits_);
+  stats["hits"]["subdomain"] = Json::UInt64(subdomainHits_);
+  stats["misses"]["primary"] = Json::UInt64(primaryMisses_);
+  stats["misses"]["subdomain"] = Json::UInt64(subdomainMisses_);
+  stats["misses"]["filtered"] = Json::UInt64(filterRejects_);
+  stats["insertConflicts"] = Json::UInt64(conflicts_);
+  stats["evictions"] = Json::UInt64(evictions_);
+  stats["refetches"] = Json::UInt64(refetches_);
+  stats["budget"] = Json::UInt64(budget_);
+
+  stats["filter"]["size"] = Json::UInt64(filter_ ? filter_->getSize() : 0);
+  stats["filter"]["count"] = Json::UInt64(filter_ ? filter_->getCount() : 0);
+  stats["filter"]["falsePositiveRate"] = falsePositiveRate_;
+  stats["memory"] = Json::UInt64(estimateMemory());
+
+  stats["hot"] = Json::Value(Json::arrayValue);
+  for (auto entry : hotNames_.getTop())
+  {
+    Json::Value hot;
+    hot["name"] = entry.first;
+    hot["count"] = entry.second;
+    stats["hot"].append(hot);
+  }
+
+  return stats;
+}
+
+
+
+void Cache::setMemoryBudget(size_t bytes)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  budget_ = bytes;
+  if (budget_ == 0)
+    referenced_.clear();  // nothing sweeps them without a budget
+  evictIfNeeded();
+}
+
+
+
+// keeps the Record of the given primary name resident regardless of budget
+void Cache::pin(const std::string& name)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  pinned_.insert(name);
+}
+
+
+
+void Cache::unpin(const std::string& name)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  pinned_.erase(name);
+}
+
+
+
+void Cache::setFetcher(const Fetcher& fetcher)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  fetcher_ = fetcher;
+}
+
+
+
+Json::Value Cache::getEstimator()
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  return reconciler_.getEstimator();
+}
+
+
+
+// approximate number of Records that only one of us and the estimator's
+// sender holds, to size the sketch sent back with Reconciler::getCellCount()
+size_t Cache::estimateDifference(const Json::Value& remoteEstimator)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  return reconciler_.estimateDifference(remoteEstimator);
+}
+
+
+
+Json::Value Cache::getSketch(size_t nCells)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  return reconciler_.getSketch(nCells);
+}
+
+
+
+// finds the Records that we hold but the sketch's sender does not, and the
+// keys of those that only the sender holds
+bool Cache::reconcile(const Json::Value& remoteSketch,
+                      std::vector<RecordPtr>& onlyHere,
+                      std::vector<uint64_t>& onlyThere)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  return reconciler_.diff(remoteSketch, onlyHere, onlyThere);
+}
+
+
+
+std::vector<RecordPtr> Cache::resolve(const std::vector<uint64_t>& keys)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  return reconciler_.resolve(keys);
+}
+
+
+
+// loads the snapshot, replays the journal on top of it, then logs to journal
+void Cache::openJournal(const std::string& snapshotPath,
+                        const std::string& journalPath)
+{
+  closeJournal();
+  snapshotPath_ = snapshotPath;
+
+  std::vector<RecordPtr> conflicts;
+  insert(Journal::readSnapshot(snapshotPath), conflicts);
+
+  // a leftover rotated journal means that a compaction was interrupted
+  std::string oldPath = journalPath + ".old";
+  bool interrupted = std::ifstream(oldPath).is_open();
+  insert(Journal::replay(oldPath), conflicts);
+  insert(Journal::replay(journalPath), conflicts);
+
+  journal_ = std::make_shared<Journal>(journalPath);
+  Log::get().notice("Cache recovered with " +
+                    std::to_string(getRecordCount()) + " Records.");
+
+  if (interrupted)
+    compact();
+}
+
+
+
+void Cache::closeJournal()
+{
+  if (compactor_.joinable())
+    compactor_.join();
+  journal_.reset();
+}
+
+
+
+// folds the journal into a new snapshot and then discards the old journal;
+// once Records have been evicted, the resident ones alone are not the full
+// set, so they are merged with the old snapshot and journal instead
+void Cache::compact()
+{
+  std::lock_guard<std::mutex> compactionLock(compactionMutex_);
+  if (!journal_)
+    return;
+
+  // an interrupted compaction leaves entries here, which rotating replaces
+  std::string oldPath = journal_->getPath() + ".old";
+  std::vector<RecordPtr> journaled = Journal::replay(oldPath);
+
+  // Records are inserted before they are logged, so each one that rotating
+  // moves aside is already resident, or evicted, when records_ is read; the
+  // rotation's syncs are thus kept outside mutex_, away from lookups
+  journal_->rotate(oldPath);
+
+  std::vector<RecordPtr> records;
+  bool hasEvicted;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    records = records_;
+    hasEvicted = evictions_ > 0;
+  }
+
+  if (hasEvicted)
+  {
+    auto rotated = Journal::replay(oldPath);
+    journaled.insert(journaled.end(), rotated.begin(), rotated.end());
+    writeSnapshot(records, journaled);
+  }
+  else
+    Journal::writeSnapshot(snapshotPath_, records);
+  std::remove(oldPath.c_str());
+}
+
+
+
+// ************************** PRIVATE METHODS **************************** //
+
+
+
+bool Cache::insert(const RecordPtr& record)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (find(record->getName()))
+  {
+    conflicts_++;
+    return false;
+  }
+
+  reserveFilter(1 + record->getSubdomainCount());
+  index(record);
+  auto pos =
+      std::upper_bound(records_.begin(), records_.end(), record, isLessThan);
+  if (static_cast<size_t>(pos - records_.begin()) < hand_)
+    hand_++;  // keep the CLOCK hand on the same Record
+  records_.insert(pos, record);
+  evictIfNeeded();
+  return true;
+}
+
+
+
+// sorts the batch, dedupes it against itself and the existing contents, and
+// merges it into records_, returning the Records that were accepted
+std::vector<RecordPtr> Cache::insert(const std::vector<RecordPtr>& records,
+                                     std::vector<RecordPtr>& conflicts)
+{
+  std::vector<RecordPtr> batch(records);
+  std::stable_sort(batch.begin(), batch.end(), isLessThan);
+
+  std::lock_guard<std::mutex> lock(mutex_);
+
+  size_t nNames = 0;
+  for (auto r : batch)
+    nNames += 1 + r->getSubdomainCount();
+  index_.reserve(index_.size() + nNames);
+  reserveFilter(nNames);
+
+  std::vector<RecordPtr> accepted;
+  for (auto r : batch)
+  {
+    if (find(r->getName()))
+    {
+      conflicts_++;
+      conflicts.push_back(r);
+    }
+    else
+    {
+      index(r);
+      accepted.push_back(r);
+    }
+  }
+
+  if (hand_ < records_.size())  // keep the CLOCK hand on the same Record
+    hand_ += std::lower_bound(accepted.begin(), accepted.end(),
+                              records_[hand_], isLessThan) -
+             accepted.begin();
+
+  // both sides are sorted, so one merge keeps records_ ordered
+  std::vector<RecordPtr> merged;
+  merged.reserve(records_.size() + accepted.size());
+  std::merge(records_.begin(), records_.end(), accepted.begin(),
+             accepted.end(), std::back_inserter(merged), isLessThan);
+  records_.swap(merged);
+  evictIfNeeded();
+
+  return accepted;
+}
+
+
+
+// appends newly inserted Records to the journal, taking them back out of
+// memory if that fails, so that the caller's failure leaves nothing behind
+// that recovery would not restore
+void Cache::log(const std::vector<RecordPtr>& records)
+{
+  try
+  {
+    journal_->append(records);
+  }
+  catch (const std::runtime_error&)
+  {
+    remove(records);
+    throw;
+  }
+}
+
+
+
+// reverses insert() for each Record that is still resident
+void Cache::remove(const std::vector<RecordPtr>& records)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (auto r : records)
+  {
+    auto pos = std::lower_bound(records_.begin(), records_.end(), r,
+                                isLessThan);
+    if (pos == records_.end() || *pos != r)
+      continue;  // evicted already
+
+    if (static_cast<size_t>(pos - records_.begin()) < hand_)
+      hand_--;  // keep the CLOCK hand on the same Record
+    records_.erase(pos);
+    unindex(r);
+  }
+}
+
+
+
+// counts a lookup of the name and finds its Record, giving it a reference;
+// on a miss that an evicted Record may explain, sets the fetcher to try;
+// caller holds mutex_
+RecordPtr Cache::access(const std::string& name, Fetcher& fetcher)
+{
+  lookups_++;
+  hotNames_.add(name);
+
+  RecordPtr record;
+  bool filtered = filter_ && !filter_->mayContain(name);
+  if (filtered)
+    filterRejects_++;
+  else
+    record = lookup(name);
+
+  if (!record && !filtered && evictions_ > 0)
+    fetcher = fetcher_;
+
+  if (record)
+  {
+    if (budget_ > 0)  // CLOCK only runs under a budget
+      referenced_.insert(record.get());
+    if (record->getName() == name)
+      primaryHits_++;
+    else
+      subdomainHits_++;
+  }
+  else
+  {  // anything with a label before the primary name is a subdomain
+    if (std::count(name.begin(), name.end(), '.') > 1)
+      subdomainMisses_++;
+    else
+      primaryMisses_++;
+  }
+
+  return record;
+}
+
+
+
+// adds the name's Record from the fetcher, without the lock as this may hit
+// the network; it may lose a race with another refetch of the same name
+bool Cache::refetch(const std::string& name, const Fetcher& fetcher)
+{
+  RecordPtr record = fetcher(name);
+  if (!record)
+    return false;
+
+  add(record);
+  std::lock_guard<std::mutex> lock(mutex_);
+  refetches_++;
+  return true;
+}
+
+
+
+// maps the Record's main name and each subdomain to it and adds it to the
+// reconciliation set; caller holds mutex_
+void Cache::index(const RecordPtr& record)
+{
+  index_.emplace(record->getName(), record);
+  filter_->insert(record->getName());
+  reconciler_.add(record);
+  residentBytes_ += getMemory(record);
+  if (budget_ > 0)
+    referenced_.insert(record.get());  // new Records start with a reference
+
+  route(record->getName(), InternedString(record->getOnion()));
+
+  for (size_t j = 0; j < record->getSubdomainCount(); j++)
+  {
+    const auto& subdomain = record->getSubdomain(j);
+    std::string fqdn = subdomain.first.str() + "." + record->getName();
+    if (index_.emplace(fqdn, record).second)
+      route(fqdn, subdomain.second);
+    filter_->insert(fqdn);
+  }
+}
+
+
+
+// reverses index(), except that the filter cannot forget names, and keeps
+// their keys for when it is rebuilt; caller holds mutex_ and removes the
+// Record from records_
+void Cache::unindex(const RecordPtr& record)
+{
+  auto erase = [&record](const std::string& fqdn)
+  {
+    auto iter = index_.find(fqdn);
+    if (iter != index_.end() && iter->second == record)
+    {
+      index_.erase(iter);
+      unroute(fqdn);
+      evictedKeys_.push_back(BloomFilter::getKey(fqdn));
+    }
+  };
+
+  erase(record->getName());
+  for (size_t j = 0; j < record->getSubdomainCount(); j++)
+    erase(record->getSubdomain(j).first.str() + "." + record->getName());
+
+  referenced_.erase(record.get());
+  reconciler_.remove(record);
+  residentBytes_ -= getMemory(record);
+}
+
+
+
+// points the FQDN at a .onion or at another .tor name, then resolves it and
+// anything that was waiting on it; caller holds mutex_
+void Cache::route(const std::string& fqdn, const InternedString& destination)
+{
+  if (Utils::strEndsWith(destination.str(), ".onion"))
+    destinations_[fqdn] = destination;
+  else
+  {
+    links_[fqdn] = destination;
+    dependents_[destination.str()].push_back(fqdn);
+  }
+
+  settle(fqdn);
+}
+
+
+
+// forgets the FQDN's route and the copies held by names that chain through
+// it, though those keep their links for when it returns; caller holds mutex_
+void Cache::unroute(const std::string& fqdn)
+{
+  auto link = links_.find(fqdn);
+  if (link != links_.end())
+  {
+    auto& siblings = dependents_[link->second.str()];
+    siblings.erase(std::remove(siblings.begin(), siblings.end(), fqdn),
+                   siblings.end());
+    if (siblings.empty())
+      dependents_.erase(link->second.str());
+    links_.erase(link);
+  }
+
+  std::vector<std::string> stale = {fqdn};
+  while (!stale.empty())
+  {
+    std::string name = stale.back();
+    stale.pop_back();
+    if (destinations_.erase(name) == 0 && name != fqdn)
+      continue;  // was never resolved, so neither were its dependents
+
+    auto dependents = dependents_.find(name);
+    if (dependents != dependents_.end())
+      stale.insert(stale.end(), dependents->second.begin(),
+                   dependents->second.end());
+  }
+}
+
+
+
+// resolves the FQDN if its chain now ends at a .onion, and likewise every
+// name chained through it; caller holds mutex_
+void Cache::settle(const std::string& fqdn)
+{
+  std::vector<std::string> pending = {fqdn};
+  while (!pending.empty())
+  {
+    std::string name = pending.back();
+    pending.pop_back();
+
+    if (links_.count(name) > 0)
+    {
+      auto destination = follow(name);
+      if (!destination)
+        continue;  // dangling or cyclic, so nothing behind it resolves
+      destinations_[name] = *destination;
+    }
+
+    auto dependents = dependents_.find(name);
+    if (dependents != dependents_.end())
+      for (const auto& dependent : dependents->second)
+        if (destinations_.count(dependent) == 0)
+          pending.push_back(dependent);
+  }
+}
+
+
+
+// walks the .tor links from the FQDN to a .onion, returning null if the chain
+// dangles or loops back on itself; caller holds mutex_
+const InternedString* Cache::follow(const std::string& fqdn)
+{
+  std::unordered_set<std::string> visited;
+  std::string name = fqdn;
+  while (visited.insert(name).second)
+  {
+    auto link = links_.find(name);
+    if (link == links_.end())
+    {
+      auto destination = destinations_.find(name);
+      return destination == destinations_.end() ? nullptr
+                                                 : &destination->second;
+    }
+
+    name = link->second.str();
+  }
+
+  Log::get().warn("Destination of " + fqdn + " loops through " + name);
+  return nullptr;
+}
+
+
+
+// approximate bytes held by a Record and its index and reconciliation entries
+size_t Cache::getMemory(const RecordPtr& record)
+{
+  const size_t ENTRY_LEN = sizeof(std::string) + sizeof(RecordPtr) +
+                           sizeof(void*);  // key, value, and next pointer
+
+  size_t nSubdomains = record->getSubdomainCount();
+  size_t bytes = sizeof(Record) + record->getName().capacity() +
+                 nSubdomains * sizeof(Subdomain);
+
+  // index and destination entries, whose destinations are interned handles
+  bytes += 2 * ENTRY_LEN + 2 * record->getName().size();
+  for (size_t j = 0; j < nSubdomains; j++)
+    bytes += 2 * ENTRY_LEN +
+             2 * (record->getSubdomain(j).first.str().size() + 1 +
+                  record->getName().size());
+
+  return bytes + sizeof(uint64_t) + sizeof(RecordPtr) + sizeof(void*);
+}
+
+
+
+// sweeps the CLOCK hand over records_, giving referenced Records a second
+// chance and evicting the unpinned rest until the Cache fits its budget;
+// caller holds mutex_
+void Cache::evictIfNeeded()
+{
+  size_t bytes = estimateMemory();
+  if (budget_ == 0 || bytes <= budget_)
+    return;
+
+  // two full turns clear every reference, so only pins can stop the sweep
+  std::unordered_set<const Record*> victims;
+  for (size_t n = 0; n < 2 * records_.size() && bytes > budget_; n++)
+  {
+    hand_ %= records_.size();
+    const RecordPtr& record = records_[hand_++];
+    if (pinned_.count(record->getName()) > 0 ||
+        victims.count(record.get()) > 0)
+      continue;
+    if (referenced_.erase(record.get()) > 0)
+      continue;  // second chance
+
+    victims.insert(record.get());
+    bytes -= std::min(bytes, getMemory(record));
+  }
+
+  if (victims.empty())
+    return;
+
+  size_t before = std::count_if(records_.begin(), records_.begin() + hand_,
+                                [&victims](const RecordPtr& r)
+                                {
+                                  return victims.count(r.get()) > 0;
+                                });
+  auto end = std::remove_if(records_.begin(), records_.end(),
+                            [&victims](const RecordPtr& r)
+                            {
+                              if (victims.count(r.get()) == 0)
+                                return false;
+                              unindex(r);
+                              return true;
+                            });
+  records_.erase(end, records_.end());
+  hand_ -= before;  // keep pointing at the same Record
+
+  evictions_ += victims.size();
+}
+
+
+
+// ensures the filter can take n more names at its false-positive rate,
+// rebuilding it at twice the size if needed from the index and the keys of
+// the evicted names, so that misses on the latter still reach the fetcher
+void Cache::reserveFilter(size_t n)
+{
+  if (filter_ && filter_->getCount() + n <= filter_->getCapacity())
+    return;
+
+  // a name evicted, refetched, and evicted again has one key here
+  std::sort(evictedKeys_.begin(), evictedKeys_.end());
+  evictedKeys_.erase(std::unique(evictedKeys_.begin(), evictedKeys_.end()),
+                     evictedKeys_.end());
+
+  size_t capacity = 2 * (index_.size() + evictedKeys_.size() + n);
+  filter_ = std::make_shared<BloomFilter>(std::max<size_t>(capacity, 1024),
+                                          falsePositiveRate_);
+  for (const auto& entry : index_)
+    filter_->insert(entry.first);
+  for (const auto& key : evictedKeys_)
+    filter_->insert(key);
+}
+
+
+
+// caller must hold mutex_
+RecordPtr Cache::find(const std::string& name)
+{
+  if (filter_ && !filter_->mayContain(name))
+    return nullptr;  // definitely not present
+
+  return lookup(name);
+}
+
+
+
+// searches only the index; caller must hold mutex_
+RecordPtr Cache::lookup(const std::string& name)
+{
+  auto iter = index_.find(name);
+  return iter == index_.end() ? nullptr : iter->second;
+}
+
+
+
+// approximate bytes held by the Cache's Records, index, and side structures
+size_t Cache::estimateMemory()
+{
+  size_t bytes = records_.capacity() * sizeof(RecordPtr);
+  bytes += index_.bucket_count() * sizeof(void*);
+  bytes += residentBytes_;
+  bytes += evictedKeys_.capacity() * sizeof(BloomFilter::Key);
+  bytes +=
+      (referenced_.bucket_count() + 2 * referenced_.size()) * sizeof(void*);
+
+  bytes += filter_ ? filter_->getSize() : 0;
+  bytes += hotNames_.getSize();
+  bytes += StringPool::get().getSize();
+  return bytes;
+}
+
+
+
+// streams the union of the resident Records, the current snapshot, and the
+// journaled Records into a new snapshot, merging all three by name; as in
+// insert(), the first Record of a name wins, so a resident one comes before
+// the snapshot's, and that before the journal's
+void Cache::writeSnapshot(const std::vector<RecordPtr>& resident,
+                          std::vector<RecordPtr> journaled)
+{
+  std::stable_sort(journaled.begin(), journaled.end(), isLessThan);
+
+  auto source = [&](const Journal::Visitor& visit)
+  {
+    std::string last;  // no Record has an empty name
+    auto emit = [&visit, &last](const RecordPtr& record)
+    {
+      if (record->getName() == last)
+        return;  // superseded
+      last = record->getName();
+      visit(record);
+    };
+
+    // emits the resident and journaled Records up to the bound, if any
+    size_t r = 0, j = 0;
+    auto drain = [&](const std::string* bound)
+    {
+      while (r < resident.size() || j < journaled.size())
+      {
+        bool fromJournal = r == resident.size() ||
+                           (j < journaled.size() &&
+                            isLessThan(journaled[j], resident[r]));
+        const RecordPtr& next = fromJournal ? journaled[j] : resident[r];
+        if (bound && (next->getName() > *bound ||
+                      (next->getName() == *bound && fromJournal)))
+          return;
+
+        emit(next);
+        if (fromJournal)
+          j++;
+        else
+          r++;
+      }
+    };
+
+    // the snapshot was written in order by an earlier compaction
+    Journal::scanSnapshot(snapshotPath_, [&](const RecordPtr& record)
+                          {
+                            std::string name = record->getName();
+                            drain(&name);
+                            emit(record);
+                          });
+    drain(nullptr);
+  };
+
+  Journal::writeSnapshot(snapshotPath_, source);
+}
+
+
+
+bool Cache::isLessThan(const RecordPtr& a, const RecordPtr& b)
+{
+  return a->getName() < b->getName();
+}
+
+
+
+// compacts in the background once the journal has grown large enough
+void Cache::compactIfNeeded()
+{
+  if (journal_->getSize() < COMPACTION_THRESHOLD || compacting_.exchange(true))
+    return;
+
+  // joins a compaction still running at exit; being constructed after Log and
+  // the Cache's own statics, it is destroyed before any of them
+  struct Joiner
+  {
+    ~Joiner()
+    {
+      if (compactor_.joinable())
+        compactor_.join();
+    }
+  };
+  static Joiner joiner;
+
+  if (compactor_.joinable())
+    compactor_.join();
+
+  compactor_ = std::thread([]()
+                           {
+                             try
+                             {
+                               compact();
+                             }
+                             catch (const std::runtime_error& err)
+                             {
+                               Log::get().warn("Compaction failed: " +
+                                               std::string(err.what()));
+                             }
+
+                             compacting_ = false;
+                           });
+}
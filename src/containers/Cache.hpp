@@ -3,19 +3,116 @@
 #define CACHE_HPP
 
 #include "records/Record.hpp"
+#include "Journal.hpp"
+#include "BloomFilter.hpp"
+#include "CountMinSketch.hpp"
+#include "Reconciler.hpp"
+#include <json/json.h>
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 class Cache
 {
  public:
+  typedef std::function<RecordPtr(const std::string&)> Fetcher;
+
   static bool add(const RecordPtr& record);
   static bool add(const std::vector<RecordPtr>&);
+  static bool add(const std::vector<RecordPtr>&, std::vector<RecordPtr>&);
   static std::vector<RecordPtr> getSortedList();
   static RecordPtr get(const std::string&);
+  static std::string getDestination(const std::string&);
   static size_t getRecordCount();
+  static void setFalsePositiveRate(double);
+  static size_t getFilterSize();
+  static Json::Value getStats();
+
+  // bounds resident memory by evicting cold Records, see evictIfNeeded()
+  static void setMemoryBudget(size_t);  // in bytes, 0 for unlimited
+  static void pin(const std::string&);
+  static void unpin(const std::string&);
+  static void setFetcher(const Fetcher&);
+
+  // delta sync with another Cache, see Reconciler
+  static Json::Value getEstimator();
+  static size_t estimateDifference(const Json::Value&);
+  static Json::Value getSketch(size_t = Reconciler::DEFAULT_CELLS);
+  static bool reconcile(const Json::Value&,
+                        std::vector<RecordPtr>&,
+                        std::vector<uint64_t>&);
+  static std::vector<RecordPtr> resolve(const std::vector<uint64_t>&);
+
+  static void openJournal(const std::string&, const std::string&);
+  static void closeJournal();
+  static void compact();
 
  private:
-  static std::vector<RecordPtr> records_;
+  static RecordPtr access(const std::string&, Fetcher&);
+  static bool refetch(const std::string&, const Fetcher&);
+  static bool insert(const RecordPtr&);
+  static std::vector<RecordPtr> insert(const std::vector<RecordPtr>&,
+                                       std::vector<RecordPtr>&);
+  static void log(const std::vector<RecordPtr>&);
+  static void remove(const std::vector<RecordPtr>&);
+  static void index(const RecordPtr&);
+  static void unindex(const RecordPtr&);
+  static void route(const std::string&, const InternedString&);
+  static void unroute(const std::string&);
+  static void settle(const std::string&);
+  static const InternedString* follow(const std::string&);
+  static size_t getMemory(const RecordPtr&);
+  static void evictIfNeeded();
+  static void reserveFilter(size_t);
+  static RecordPtr find(const std::string&);
+  static RecordPtr lookup(const std::string&);
+  static size_t estimateMemory();
+  static bool isLessThan(const RecordPtr&, const RecordPtr&);
+  static void writeSnapshot(const std::vector<RecordPtr>&,
+                            std::vector<RecordPtr>);
+  static void compactIfNeeded();
+
+  static const size_t COMPACTION_THRESHOLD = 1 << 26;  // bytes of journal
+
+  static std::vector<RecordPtr> records_;  // sorted by name
+  static std::unordered_map<std::string, RecordPtr> index_;  // FQDN -> Record
+  static std::mutex mutex_;
+
+  // FQDN -> final .onion, following chains of .tor destinations; the
+  // destinations are interned, as many names share each one
+  static std::unordered_map<std::string, InternedString> destinations_;
+  static std::unordered_map<std::string, InternedString> links_;  // next hop
+  static std::unordered_map<std::string, std::vector<std::string> > dependents_;
+
+  // front for the index so that definite misses never touch it
+  static std::shared_ptr<BloomFilter> filter_;
+  static double falsePositiveRate_;
+
+  // statistics, guarded by mutex_
+  static uint64_t lookups_, primaryHits_, subdomainHits_;
+  static uint64_t primaryMisses_, subdomainMisses_, filterRejects_;
+  static uint64_t conflicts_, evictions_, refetches_;
+  static CountMinSketch hotNames_;
+
+  static Reconciler reconciler_;
+
+  // CLOCK eviction; the filter keeps evicted names so they can be refetched,
+  // and evictedKeys_ holds their keys for when it is rebuilt
+  static size_t budget_, residentBytes_, hand_;
+  static std::vector<BloomFilter::Key> evictedKeys_;
+  static std::unordered_set<const Record*> referenced_;  // since last sweep
+  static std::unordered_set<std::string> pinned_;
+  static Fetcher fetcher_;
+
+  static std::shared_ptr<Journal> journal_;
+  static std::string snapshotPath_;
+  static std::mutex compactionMutex_;
+  static std::atomic<bool> compacting_;
+  static std::thread compactor_;
 };
 
 #endif
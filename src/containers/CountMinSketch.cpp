@@ -0,0 +1,102 @@
+
+#include "CountMinSketch.hpp"
+#include "../Utils.hpp"
+#include <functional>
+#include <algorithm>
+
+
+CountMinSketch::CountMinSketch(size_t width, size_t depth, size_t k)
+    : width_(width), depth_(depth), k_(k), counters_(width * depth, 0)
+{
+}
+
+
+
+// counts one occurrence of the name and returns its new estimate
+uint32_t CountMinSketch::add(const std::string& name)
+{
+  uint64_t h1 = std::hash<std::string>()(name);
+  uint64_t h2 = Utils::fnv1a(name) | 1;
+
+  uint32_t estimate = UINT32_MAX;
+  for (size_t row = 0; row < depth_; row++)
+  {
+    uint32_t& counter = counters_[row * width_ + (h1 + row * h2) % width_];
+    if (counter < UINT32_MAX)
+      counter++;
+    estimate = std::min(estimate, counter);
+  }
+
+  updateTop(name, estimate);
+  return estimate;
+}
+
+
+
+uint32_t CountMinSketch::estimate(const std::string& name) const
+{
+  uint64_t h1 = std::hash<std::string>()(name);
+  uint64_t h2 = Utils::fnv1a(name) | 1;
+
+  uint32_t estimate = UINT32_MAX;
+  for (size_t row = 0; row < depth_; row++)
+    estimate = std::min(estimate,
+                        counters_[row * width_ + (h1 + row * h2) % width_]);
+  return estimate;
+}
+
+
+
+// returns the hottest names, highest count first
+std::vector<std::pair<std::string, uint32_t> > CountMinSketch::getTop() const
+{
+  std::vector<std::pair<std::string, uint32_t> > top(top_.begin(), top_.end());
+  std::sort(top.begin(), top.end(),
+            [](const std::pair<std::string, uint32_t>& a,
+               const std::pair<std::string, uint32_t>& b)
+            {
+              return a.second > b.second;
+            });
+  return top;
+}
+
+
+
+size_t CountMinSketch::getSize() const
+{
+  return counters_.size() * sizeof(uint32_t);
+}
+
+
+
+// ************************** PRIVATE METHODS **************************** //
+
+
+
+void CountMinSketch::updateTop(const std::string& name, uint32_t estimate)
+{
+  auto iter = top_.find(name);
+  if (iter != top_.end())
+  {
+    iter->second = estimate;
+    return;
+  }
+
+  if (top_.size() < k_)
+  {
+    top_.emplace(name, estimate);
+    return;
+  }
+
+  // replace the coldest of the current top names if this one is hotter
+  auto coldest = top_.begin();
+  for (auto i = top_.begin(); i != top_.end(); ++i)
+    if (i->second < coldest->second)
+      coldest = i;
+
+  if (coldest != top_.end() && estimate > coldest->second)
+  {
+    top_.erase(coldest);
+    top_.emplace(name, estimate);
+  }
+}
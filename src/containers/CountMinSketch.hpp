@@ -0,0 +1,29 @@
+
+#ifndef COUNT_MIN_SKETCH_HPP
+#define COUNT_MIN_SKETCH_HPP
+
+#include <unordered_map>
+#include <vector>
+#include <string>
+#include <cstdint>
+
+// Approximate per-name frequency counts in fixed memory, plus the k names
+// with the highest estimated counts seen so far.
+class CountMinSketch
+{
+ public:
+  CountMinSketch(size_t, size_t, size_t);
+  uint32_t add(const std::string&);
+  uint32_t estimate(const std::string&) const;
+  std::vector<std::pair<std::string, uint32_t> > getTop() const;
+  size_t getSize() const;  // in bytes
+
+ private:
+  void updateTop(const std::string&, uint32_t);
+
+  const size_t width_, depth_, k_;
+  std::vector<uint32_t> counters_;  // depth_ rows of width_ counters
+  std::unordered_map<std::string, uint32_t> top_;
+};
+
+#endif
@@ -0,0 +1,187 @@
+
+#include "InvertibleBloomTable.hpp"
+#include "../Log.hpp"
+#include <botan/base64.h>
+#include <algorithm>
+
+
+InvertibleBloomTable::InvertibleBloomTable(size_t nCells)
+    : subtableSize_(std::max<size_t>(nCells / N_HASHES, 1))
+{
+  // one subtable per hash function, so a key never hits a cell twice
+  cells_.resize(subtableSize_ * N_HASHES, Cell{0, 0, 0});
+}
+
+
+
+void InvertibleBloomTable::insert(uint64_t key)
+{
+  update(key, 1);
+}
+
+
+
+void InvertibleBloomTable::erase(uint64_t key)
+{
+  update(key, -1);
+}
+
+
+
+// leaves this table holding the difference between the two sets
+void InvertibleBloomTable::subtract(const InvertibleBloomTable& other)
+{
+  if (other.cells_.size() != cells_.size())
+    Log::get().error("Cannot subtract tables of different sizes.");
+
+  for (size_t j = 0; j < cells_.size(); j++)
+  {
+    cells_[j].count_ -= other.cells_[j].count_;
+    cells_[j].keySum_ ^= other.cells_[j].keySum_;
+    cells_[j].hashSum_ ^= other.cells_[j].hashSum_;
+  }
+}
+
+
+
+// lists the keys with positive and negative counts by repeatedly peeling
+// pure cells, returning false if the difference was too large to recover
+bool InvertibleBloomTable::decode(std::vector<uint64_t>& positive,
+                                  std::vector<uint64_t>& negative) const
+{
+  InvertibleBloomTable table(*this);
+
+  std::vector<size_t> pure;
+  for (size_t j = 0; j < table.cells_.size(); j++)
+    if (table.isPure(table.cells_[j]))
+      pure.push_back(j);
+
+  while (!pure.empty())
+  {
+    const Cell& cell = table.cells_[pure.back()];
+    pure.pop_back();
+    if (!table.isPure(cell))
+      continue;  // already peeled through another cell
+
+    uint64_t key = cell.keySum_;
+    int32_t count = cell.count_;
+    (count > 0 ? positive : negative).push_back(key);
+    table.update(key, -count);
+
+    for (size_t j = 0; j < N_HASHES; j++)
+    {
+      size_t index = j * subtableSize_ + mix(key + j) % subtableSize_;
+      if (table.isPure(table.cells_[index]))
+        pure.push_back(index);
+    }
+  }
+
+  for (auto cell : table.cells_)
+    if (cell.count_ != 0 || cell.keySum_ != 0 || cell.hashSum_ != 0)
+      return false;
+  return true;
+}
+
+
+
+size_t InvertibleBloomTable::getCellCount() const
+{
+  return cells_.size();
+}
+
+
+
+Json::Value InvertibleBloomTable::asJSON() const
+{
+  std::vector<uint8_t> bytes;
+  bytes.reserve(cells_.size() * CELL_LEN);
+  for (auto cell : cells_)
+  {
+    for (int shift = 24; shift >= 0; shift -= 8)
+      bytes.push_back(static_cast<uint8_t>(cell.count_ >> shift));
+    for (int shift = 56; shift >= 0; shift -= 8)
+      bytes.push_back(static_cast<uint8_t>(cell.keySum_ >> shift));
+    for (int shift = 56; shift >= 0; shift -= 8)
+      bytes.push_back(static_cast<uint8_t>(cell.hashSum_ >> shift));
+  }
+
+  Json::Value value;
+  value["cells"] = static_cast<Json::UInt>(cells_.size());
+  value["table"] = Botan::base64_encode(bytes.data(), bytes.size());
+  return value;
+}
+
+
+
+// the sketch comes from the other side, so its claimed size is checked
+// against MAX_CELLS and the encoded table before anything is allocated
+InvertibleBloomTable InvertibleBloomTable::fromJSON(const Json::Value& value)
+{
+  if (!value.isObject() || !value["cells"].isUInt() ||
+      !value["table"].isString())
+    Log::get().error("Invalid invertible Bloom table.");
+
+  size_t nCells = value["cells"].asUInt();
+  std::string base64 = value["table"].asString();
+  if (nCells == 0 || nCells > MAX_CELLS || nCells % N_HASHES != 0 ||
+      base64.size() != (nCells * CELL_LEN + 2) / 3 * 4)
+    Log::get().error("Invalid size of invertible Bloom table.");
+
+  InvertibleBloomTable table(nCells);
+  std::vector<uint8_t> bytes(base64.size());
+  size_t len = Botan::base64_decode(bytes.data(), base64);
+  if (len != table.cells_.size() * CELL_LEN)
+    Log::get().error("Invalid size of invertible Bloom table.");
+
+  const uint8_t* ptr = bytes.data();
+  for (auto& cell : table.cells_)
+  {
+    uint32_t count = 0;
+    for (int j = 0; j < 4; j++)
+      count = count << 8 | *ptr++;
+    cell.count_ = static_cast<int32_t>(count);
+    for (int j = 0; j < 8; j++)
+      cell.keySum_ = cell.keySum_ << 8 | *ptr++;
+    for (int j = 0; j < 8; j++)
+      cell.hashSum_ = cell.hashSum_ << 8 | *ptr++;
+  }
+
+  return table;
+}
+
+
+
+// ************************** PRIVATE METHODS **************************** //
+
+
+
+void InvertibleBloomTable::update(uint64_t key, int32_t count)
+{
+  uint64_t check = mix(~key);
+  for (size_t j = 0; j < N_HASHES; j++)
+  {
+    Cell& cell = cells_[j * subtableSize_ + mix(key + j) % subtableSize_];
+    cell.count_ += count;
+    cell.keySum_ ^= key;
+    if (count % 2 != 0)
+      cell.hashSum_ ^= check;
+  }
+}
+
+
+
+// a cell holding exactly one key, from either side
+bool InvertibleBloomTable::isPure(const Cell& cell) const
+{
+  return (cell.count_ == 1 || cell.count_ == -1) &&
+         cell.hashSum_ == mix(~cell.keySum_);
+}
+
+
+
+uint64_t InvertibleBloomTable::mix(uint64_t x)
+{  // splitmix64 finalizer, http://xoroshiro.di.unimi.it/splitmix64.c
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
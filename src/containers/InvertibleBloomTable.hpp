@@ -0,0 +1,46 @@
+
+#ifndef INVERTIBLE_BLOOM_TABLE_HPP
+#define INVERTIBLE_BLOOM_TABLE_HPP
+
+#include <json/json.h>
+#include <vector>
+#include <cstdint>
+
+// Invertible Bloom lookup table over 64-bit keys. Subtracting one side's
+// table from the other's leaves only the symmetric difference, which can be
+// listed as long as it is small relative to the number of cells.
+// https://www.ics.uci.edu/~eppstein/pubs/EppGooUye-SIGCOMM-11.pdf
+class InvertibleBloomTable
+{
+ public:
+  InvertibleBloomTable(size_t);
+  void insert(uint64_t);
+  void erase(uint64_t);
+  void subtract(const InvertibleBloomTable&);
+  bool decode(std::vector<uint64_t>&, std::vector<uint64_t>&) const;
+  size_t getCellCount() const;
+
+  Json::Value asJSON() const;
+  static InvertibleBloomTable fromJSON(const Json::Value&);
+
+  static const size_t MAX_CELLS = 1 << 20;  // accepted from the other side
+
+ private:
+  struct Cell
+  {
+    int32_t count_;
+    uint64_t keySum_, hashSum_;
+  };
+
+  void update(uint64_t, int32_t);
+  bool isPure(const Cell&) const;
+  static uint64_t mix(uint64_t);
+
+  static const size_t N_HASHES = 3;
+  static const size_t CELL_LEN = 20;  // bytes when serialized
+
+  std::vector<Cell> cells_;
+  size_t subtableSize_;
+};
+
+#endif
@@ -0,0 +1,372 @@
+
+#include "Journal.hpp"
+#include "../Common.hpp"
+#include "../Log.hpp"
+#include <botan/crc32.h>
+#include <fstream>
+#include <iterator>
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+
+
+Journal::Journal(const std::string& path)
+    : path_(path),
+      fd_(-1),
+      size_(0),
+      appendSeq_(0),
+      durableSeq_(0),
+      flushing_(false),
+      failed_(false)
+{
+  open();
+}
+
+
+
+Journal::~Journal()
+{
+  if (fd_ >= 0)
+    close(fd_);
+}
+
+
+
+// encodes the Records and blocks until they and all earlier entries are
+// synced, throwing if they could not be
+void Journal::append(const std::vector<RecordPtr>& records)
+{
+  std::string buffer;
+  for (auto r : records)
+    encode(r, buffer);
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (failed_)
+    Log::get().error("Journal " + path_ + " failed earlier.");
+  pending_ += buffer;
+  uint64_t ticket = ++appendSeq_;
+
+  while (durableSeq_ < ticket)
+  {
+    if (failed_)
+      Log::get().error("Failed to sync journal " + path_);
+    if (flushing_)
+      flushed_.wait(lock);  // another appender is syncing our batch
+    else
+      flush(lock);  // become the leader for everything pending
+  }
+}
+
+
+
+// moves the current log to the given path and starts a fresh, empty log
+void Journal::rotate(const std::string& oldPath)
+{
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (flushing_ || !pending_.empty())
+  {
+    if (flushing_)
+      flushed_.wait(lock);
+    else
+      flush(lock);
+  }
+
+  close(fd_);
+  if (std::rename(path_.c_str(), oldPath.c_str()) != 0)
+    Log::get().error("Failed to rotate journal " + path_);
+
+  open();
+  syncDirectory(path_);
+}
+
+
+
+size_t Journal::getSize() const
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  return size_;
+}
+
+
+
+std::string Journal::getPath() const
+{
+  return path_;
+}
+
+
+
+// returns every intact entry in the log, truncating any torn tail
+std::vector<RecordPtr> Journal::replay(const std::string& path)
+{
+  std::vector<RecordPtr> records;
+
+  std::ifstream file(path, std::ifstream::binary);
+  if (!file.is_open())
+    return records;
+
+  std::string data((std::istreambuf_iterator<char>(file)),
+                   std::istreambuf_iterator<char>());
+  file.close();
+
+  size_t offset = 0;
+  while (offset + 8 <= data.size())
+  {
+    auto header = reinterpret_cast<const uint8_t*>(data.data() + offset);
+    uint32_t length = static_cast<uint32_t>(header[0]) << 24 |
+                      static_cast<uint32_t>(header[1]) << 16 |
+                      static_cast<uint32_t>(header[2]) << 8 | header[3];
+    if (offset + 8 + length > data.size())
+      break;  // entry was only partially written
+
+    Botan::CRC32 crc;
+    auto checksum = crc.process(header + 8, length);
+    if (memcmp(checksum, header + 4, 4) != 0)
+      break;  // entry is corrupt
+
+    try
+    {
+      records.push_back(Common::parseRecord(data.substr(offset + 8, length)));
+    }
+    catch (const std::runtime_error& err)
+    {
+      Log::get().warn("Skipping invalid journal entry: " +
+                      std::string(err.what()));
+    }
+
+    offset += 8 + length;
+  }
+
+  if (offset < data.size())
+  {
+    Log::get().warn("Truncating " + std::to_string(data.size() - offset) +
+                    " bytes of incomplete journal entries from " + path);
+    if (truncate(path.c_str(), static_cast<off_t>(offset)) != 0)
+      Log::get().error("Failed to truncate journal " + path);
+  }
+
+  Log::get().notice("Replayed " + std::to_string(records.size()) +
+                    " Records from " + path);
+  return records;
+}
+
+
+
+// atomically replaces the snapshot at path with one Record JSON per line
+void Journal::writeSnapshot(const std::string& path,
+                            const std::vector<RecordPtr>& records)
+{
+  writeSnapshot(path, [&records](const Visitor& visit)
+                {
+                  for (auto r : records)
+                    visit(r);
+                });
+}
+
+
+
+// as above, but streams the Records that the source visits, so they need
+// not all be held at once
+void Journal::writeSnapshot(const std::string& path, const Source& source)
+{
+  std::string tmpPath = path + ".tmp";
+  int fd = ::open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  if (fd < 0)
+    Log::get().error("Cannot open snapshot " + tmpPath);
+
+  std::string buffer;
+  size_t count = 0;
+  bool failed = false;
+  try
+  {
+    source([fd, &buffer, &count, &failed](const RecordPtr& record)
+           {
+             if (failed)
+               return;
+             buffer += record->asJSON();
+             count++;
+             if (buffer.size() >= 1 << 20)
+             {
+               failed = !writeAll(fd, buffer);
+               buffer.clear();
+             }
+           });
+  }
+  catch (const std::exception&)
+  {
+    close(fd);
+    std::remove(tmpPath.c_str());
+    throw;
+  }
+
+  bool success = !failed && writeAll(fd, buffer) && fdatasync(fd) == 0;
+  close(fd);
+  if (!success)
+    Log::get().error("Failed to write snapshot " + tmpPath);
+
+  if (std::rename(tmpPath.c_str(), path.c_str()) != 0)
+    Log::get().error("Failed to replace snapshot " + path);
+  syncDirectory(path);
+
+  Log::get().notice("Wrote snapshot of " + std::to_string(count) +
+                    " Records to " + path);
+}
+
+
+
+std::vector<RecordPtr> Journal::readSnapshot(const std::string& path)
+{
+  std::vector<RecordPtr> records;
+  scanSnapshot(path, [&records](const RecordPtr& record)
+               {
+                 records.push_back(record);
+               });
+
+  Log::get().notice("Loaded " + std::to_string(records.size()) +
+                    " Records from snapshot " + path);
+  return records;
+}
+
+
+
+// passes each Record of the snapshot to the callback in turn, in the order
+// they were written, without holding more than one of them; a missing
+// snapshot is empty, and invalid lines are skipped as in replay()
+size_t Journal::scanSnapshot(const std::string& path, const Visitor& callback)
+{
+  std::ifstream file(path);
+  if (!file.is_open())
+    return 0;
+
+  size_t count = 0, skipped = 0;
+  std::string line;
+  while (std::getline(file, line))
+  {
+    if (line.empty())
+      continue;
+
+    RecordPtr record;
+    try
+    {
+      record = Common::parseRecord(line);
+    }
+    catch (const std::runtime_error& err)
+    {
+      Log::get().warn("Skipping invalid snapshot line: " +
+                      std::string(err.what()));
+      skipped++;
+      continue;
+    }
+
+    callback(record);
+    count++;
+  }
+
+  if (skipped > 0)
+    Log::get().warn("Skipped " + std::to_string(skipped) +
+                    " invalid lines of snapshot " + path);
+  return count;
+}
+
+
+
+// ************************** PRIVATE METHODS **************************** //
+
+
+
+void Journal::open()
+{
+  fd_ = ::open(path_.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0600);
+  if (fd_ < 0)
+    Log::get().error("Cannot open journal " + path_);
+
+  off_t end = lseek(fd_, 0, SEEK_END);
+  size_ = end < 0 ? 0 : static_cast<size_t>(end);
+}
+
+
+
+// writes and syncs everything pending; the lock is released during the I/O.
+// After a failed write or sync the file's contents are unknown, so the batch
+// is cut off, the journal refuses further entries, and every appender whose
+// entry was pending fails
+void Journal::flush(std::unique_lock<std::mutex>& lock)
+{
+  std::string batch;
+  batch.swap(pending_);
+  uint64_t seq = appendSeq_;
+  flushing_ = true;
+
+  lock.unlock();
+  bool success = writeAll(fd_, batch) && fdatasync(fd_) == 0;
+  lock.lock();
+
+  flushing_ = false;
+  if (success)
+  {
+    durableSeq_ = seq;
+    size_ += batch.size();
+  }
+  else
+  {
+    failed_ = true;
+    pending_.clear();
+    if (ftruncate(fd_, static_cast<off_t>(size_)) != 0)
+      Log::get().warn("Failed to cut off journal " + path_);
+  }
+  flushed_.notify_all();
+
+  if (!success)
+    Log::get().error("Failed to sync journal " + path_);
+}
+
+
+
+void Journal::encode(const RecordPtr& record, std::string& buffer)
+{
+  std::string json = record->asJSON();
+  uint32_t length = static_cast<uint32_t>(json.size());
+
+  Botan::CRC32 crc;
+  auto checksum = crc.process(reinterpret_cast<const uint8_t*>(json.data()),
+                              json.size());
+  const uint8_t* checksumBytes = checksum;
+
+  buffer.push_back(static_cast<char>(length >> 24));
+  buffer.push_back(static_cast<char>(length >> 16));
+  buffer.push_back(static_cast<char>(length >> 8));
+  buffer.push_back(static_cast<char>(length));
+  buffer.append(reinterpret_cast<const char*>(checksumBytes), 4);
+  buffer += json;
+}
+
+
+
+bool Journal::writeAll(int fd, const std::string& data)
+{
+  size_t written = 0;
+  while (written < data.size())
+  {
+    ssize_t n = write(fd, data.data() + written, data.size() - written);
+    if (n < 0)
+      return false;
+    written += static_cast<size_t>(n);
+  }
+
+  return true;
+}
+
+
+
+// makes a rename within the file's directory durable
+void Journal::syncDirectory(const std::string& path)
+{
+  auto slash = path.find_last_of('/');
+  std::string dir = slash == std::string::npos ? "." : path.substr(0, slash);
+
+  int fd = ::open(dir.c_str(), O_RDONLY);
+  if (fd < 0)
+    return;
+  fsync(fd);
+  close(fd);
+}
@@ -0,0 +1,57 @@
+
+#ifndef JOURNAL_HPP
+#define JOURNAL_HPP
+
+#include "records/Record.hpp"
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <vector>
+#include <string>
+
+// Append-only write-ahead log of accepted Records. Each entry is framed as
+// [4-byte length][4-byte CRC32][Record JSON]. Concurrent appenders are
+// group-committed: one of them becomes the leader and writes and fsyncs every
+// pending entry at once, so the cost of an fsync is shared by the whole batch.
+class Journal
+{
+ public:
+  Journal(const std::string&);
+  ~Journal();
+
+  void append(const std::vector<RecordPtr>&);  // returns once durable
+  void rotate(const std::string&);
+  size_t getSize() const;
+  std::string getPath() const;
+
+  typedef std::function<void(const RecordPtr&)> Visitor;
+  typedef std::function<void(const Visitor&)> Source;  // visits each Record
+
+  static std::vector<RecordPtr> replay(const std::string&);
+  static void writeSnapshot(const std::string&, const std::vector<RecordPtr>&);
+  static void writeSnapshot(const std::string&, const Source&);
+  static std::vector<RecordPtr> readSnapshot(const std::string&);
+  static size_t scanSnapshot(const std::string&, const Visitor&);
+
+ private:
+  Journal(const Journal&) = delete;
+  void operator=(const Journal&) = delete;
+
+  void open();
+  void flush(std::unique_lock<std::mutex>&);
+  static void encode(const RecordPtr&, std::string&);
+  static bool writeAll(int, const std::string&);
+  static void syncDirectory(const std::string&);
+
+  std::string path_;
+  int fd_;
+  size_t size_;
+
+  mutable std::mutex mutex_;
+  std::condition_variable flushed_;
+  std::string pending_;
+  uint64_t appendSeq_, durableSeq_;
+  bool flushing_, failed_;
+};
+
+#endif
@@ -0,0 +1,292 @@
+
+#include "MerkleBuilder.hpp"
+#include "Journal.hpp"
+#include "../Log.hpp"
+#include "../crypto/MultiSHA384.hpp"
+#include <cstring>
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+
+
+MerkleBuilder::MerkleBuilder() : size_(0), finished_(false), namesSize_(0)
+{
+  offsets_.fd = names_.fd = -1;
+}
+
+
+
+MerkleBuilder::MerkleBuilder(const std::string& path) : MerkleBuilder()
+{
+  path_ = path;
+  openSpill(getSpill(0), path_ + ".tmp");
+  openSpill(offsets_, path_ + ".tmp.offsets");
+  openSpill(names_, path_ + ".tmp.names");
+
+  // filled in by finish(), once the levels are known
+  char header[sizeof(MerkleTree::FileHeader)] = {};
+  write(levels_[0], header, sizeof(header));
+}
+
+
+
+// an unfinished file is discarded
+MerkleBuilder::~MerkleBuilder()
+{
+  close();
+  if (!finished_ && !path_.empty())
+    std::remove((path_ + ".tmp").c_str());
+}
+
+
+
+// adds the next leaf, whose name must sort after every one before it; the
+// nodes it completes are hashed at once, so nothing is hashed twice
+void MerkleBuilder::add(const std::string& name, const SHA384_HASH& leaf)
+{
+  if (finished_)
+    Log::get().error("Merkle tree is already finished.");
+  if (size_ > 0 && !(lastName_ < name))
+    Log::get().error("Merkle leaves are out of order at " + name);
+  lastName_ = name;
+
+  if (!path_.empty())
+  {
+    write(offsets_, &namesSize_, sizeof(namesSize_));
+    write(names_, name.data(), name.size());
+    namesSize_ += name.size();
+  }
+
+  // like a binary counter: each set bit of size_ is a left sibling to join
+  SHA384_HASH hash = leaf;
+  emit(0, hash);
+  size_t level = 0;
+  for (; size_ >> level & 1; level++)
+  {
+    hash = MultiSHA384::hash(pending_[level], hash);
+    emit(level + 1, hash);
+  }
+
+  if (pending_.size() <= level)
+    pending_.resize(level + 1);
+  pending_[level] = hash;
+  size_++;
+}
+
+
+
+void MerkleBuilder::add(const RecordPtr& record)
+{
+  add(record->getName(), record->getHash());
+}
+
+
+
+// completes the right edge, pairing the last node of each odd level with
+// itself as MerkleTree does, and returns the root; the file is then written
+SHA384_HASH MerkleBuilder::finish()
+{
+  if (finished_)
+    Log::get().error("Merkle tree is already finished.");
+
+  // carry is the last node of the current level, if finishing made one
+  bool hasCarry = false;
+  SHA384_HASH carry;
+  size_t level = 0;
+  for (size_t width = size_; width > 1; width = (width + 1) / 2, level++)
+  {
+    bool hasPending = size_ >> level & 1;
+    if (hasPending && hasCarry)
+      carry = MultiSHA384::hash(pending_[level], carry);
+    else if (hasPending)
+      carry = MultiSHA384::hash(pending_[level], pending_[level]);
+    else if (hasCarry)
+      carry = MultiSHA384::hash(carry, carry);
+    else
+      continue;  // this level pairs up exactly
+
+    hasCarry = true;
+    emit(level + 1, carry);
+  }
+
+  SHA384_HASH root;
+  if (hasCarry)
+    root = carry;
+  else if (size_ > 0)
+    root = pending_[level];
+  else
+    root.fill(0);  // as for an empty tree
+
+  if (!path_.empty())
+    writeFile(root);
+  finished_ = true;
+
+  Log::get().notice("Streamed Merkle tree of " + std::to_string(size_) +
+                    " leaves. Root is " + MerkleTree::encode(root));
+  return root;
+}
+
+
+
+size_t MerkleBuilder::getSize() const
+{
+  return size_;
+}
+
+
+
+// streams the snapshot, which Cache keeps sorted by name, into a tree file
+// at the given path and maps it, so only one Record is held at a time
+MerkleTreePtr MerkleBuilder::fromSnapshot(const std::string& snapshotPath,
+                                          const std::string& treePath)
+{
+  MerkleBuilder builder(treePath);
+  Journal::scanSnapshot(snapshotPath, [&builder](const RecordPtr& record)
+                        {
+                          builder.add(record);
+                        });
+  builder.finish();
+  return std::make_shared<MerkleTree>(treePath, builder.getSize());
+}
+
+
+
+// ************************** PRIVATE METHODS **************************** //
+
+
+
+// appends a completed node to its level's section of the file
+void MerkleBuilder::emit(size_t level, const SHA384_HASH& hash)
+{
+  if (path_.empty())
+    return;
+
+  Spill& spill = getSpill(level);
+  if (spill.fd < 0)
+    openSpill(spill, path_ + ".tmp." + std::to_string(level));
+  write(spill, hash.data(), hash.size());
+}
+
+
+
+MerkleBuilder::Spill& MerkleBuilder::getSpill(size_t level)
+{
+  while (levels_.size() <= level)
+  {
+    levels_.emplace_back();
+    levels_.back().fd = -1;
+  }
+
+  return levels_[level];
+}
+
+
+
+void MerkleBuilder::openSpill(Spill& spill, const std::string& path)
+{
+  spill.path = path;
+  spill.fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+  if (spill.fd < 0)
+    Log::get().error("Cannot open Merkle tree " + path);
+}
+
+
+
+void MerkleBuilder::write(Spill& spill, const void* data, size_t size)
+{
+  spill.buffer.append(static_cast<const char*>(data), size);
+  if (spill.buffer.size() >= SPILL_BUFFER)
+    flush(spill);
+}
+
+
+
+void MerkleBuilder::flush(Spill& spill)
+{
+  if (!MerkleTree::writeAll(spill.fd, spill.buffer.data(),
+                            spill.buffer.size()))
+    Log::get().error("Failed to write Merkle tree " + spill.path);
+  spill.buffer.clear();
+}
+
+
+
+// copies a spilled section onto the end of the file, then deletes it
+void MerkleBuilder::append(int fd, Spill& spill)
+{
+  flush(spill);
+  if (lseek(spill.fd, 0, SEEK_SET) != 0)
+    Log::get().error("Cannot read Merkle tree " + spill.path);
+
+  std::string buffer(1 << 20, '\0');
+  ssize_t n;
+  while ((n = read(spill.fd, &buffer[0], buffer.size())) > 0)
+    if (!MerkleTree::writeAll(fd, buffer.data(), static_cast<size_t>(n)))
+      Log::get().error("Failed to write Merkle tree " + path_ + ".tmp");
+  if (n < 0)
+    Log::get().error("Cannot read Merkle tree " + spill.path);
+
+  ::close(spill.fd);
+  spill.fd = -1;
+  std::remove(spill.path.c_str());
+}
+
+
+
+// joins the sections after level 0 in the order that MerkleTree maps them,
+// fills in the header, and then replaces any previous file atomically
+void MerkleBuilder::writeFile(const SHA384_HASH& root)
+{
+  write(offsets_, &namesSize_, sizeof(namesSize_));
+
+  Spill& file = levels_[0];
+  flush(file);
+  for (size_t level = 1; level < levels_.size(); level++)
+    append(file.fd, levels_[level]);
+  append(file.fd, offsets_);
+  append(file.fd, names_);
+
+  MerkleTree::FileHeader header;
+  memset(&header, 0, sizeof(header));
+  header.magic = MerkleTree::FILE_MAGIC;
+  header.version = MerkleTree::FILE_VERSION;
+  header.levelCount = static_cast<uint32_t>(levels_.size());
+  header.leafCount = size_;
+  header.namesSize = namesSize_;
+  memcpy(header.root, root.data(), Const::SHA384_LEN);
+
+  bool success = pwrite(file.fd, &header, sizeof(header), 0) ==
+                     static_cast<ssize_t>(sizeof(header)) &&
+                 fdatasync(file.fd) == 0;
+  close();
+  if (!success)
+    Log::get().error("Failed to write Merkle tree " + file.path);
+  if (std::rename(file.path.c_str(), path_.c_str()) != 0)
+    Log::get().error("Failed to replace Merkle tree " + path_);
+
+  Log::get().notice("Wrote Merkle tree of " + std::to_string(size_) +
+                    " leaves to " + path_);
+}
+
+
+
+// closes every section, deleting all but the file itself
+void MerkleBuilder::close()
+{
+  for (auto spill : {&offsets_, &names_})
+    if (spill->fd >= 0)
+    {
+      ::close(spill->fd);
+      std::remove(spill->path.c_str());
+      spill->fd = -1;
+    }
+
+  for (size_t level = 0; level < levels_.size(); level++)
+    if (levels_[level].fd >= 0)
+    {
+      ::close(levels_[level].fd);
+      if (level > 0)
+        std::remove(levels_[level].path.c_str());
+      levels_[level].fd = -1;
+    }
+}
@@ -0,0 +1,67 @@
+
+#ifndef MERKLE_BUILDER_HPP
+#define MERKLE_BUILDER_HPP
+
+#include "MerkleTree.hpp"
+#include "records/Record.hpp"
+#include "../Constants.hpp"
+#include <vector>
+#include <string>
+
+// Computes the root of a MerkleTree from leaves streamed in sorted order,
+// holding only one pending node per level rather than every Record and leaf.
+// Given a path, it also streams the levels and names to a file in the format
+// of MerkleTree::save(), so a large tree can be mapped without ever being
+// built in memory.
+class MerkleBuilder
+{
+ public:
+  MerkleBuilder();
+  MerkleBuilder(const std::string&);  // writes a file for MerkleTree to map
+  ~MerkleBuilder();
+
+  void add(const std::string&, const SHA384_HASH&);
+  void add(const RecordPtr&);
+  SHA384_HASH finish();
+  size_t getSize() const;
+
+  // builds the file from a snapshot written by Journal, then maps it
+  static MerkleTreePtr fromSnapshot(const std::string&, const std::string&);
+
+ private:
+  MerkleBuilder(const MerkleBuilder&) = delete;
+  void operator=(const MerkleBuilder&) = delete;
+
+  struct Spill
+  {  // buffered writes to one section of the file
+    int fd;
+    std::string path, buffer;
+  };
+
+  void emit(size_t, const SHA384_HASH&);
+  Spill& getSpill(size_t);
+  void openSpill(Spill&, const std::string&);
+  void write(Spill&, const void*, size_t);
+  void flush(Spill&);
+  void append(int, Spill&);
+  void writeFile(const SHA384_HASH&);
+  void close();
+
+  static const size_t SPILL_BUFFER = 1 << 16;
+
+  // the node of each level still waiting for its right sibling; level l has
+  // one exactly when bit l of size_ is set
+  std::vector<SHA384_HASH> pending_;
+  size_t size_;
+  std::string lastName_;
+  bool finished_;
+
+  // the file is written as path_.tmp, with level 0 following the header
+  // directly and the higher levels and the names spilled alongside it
+  std::string path_;
+  std::vector<Spill> levels_;
+  Spill offsets_, names_;
+  uint64_t namesSize_;
+};
+
+#endif
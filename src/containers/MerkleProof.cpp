@@ -0,0 +1,345 @@
+
+#include "MerkleProof.hpp"
+#include "../Log.hpp"
+#include "../crypto/MultiSHA384.hpp"
+#include <cstring>
+
+
+MerkleProof::MerkleProof(const std::string& proof)
+    : kind_(0), flags_(0), left_(), right_(), common_()
+{
+  parse(proof);
+}
+
+
+
+// the JSON is converted through the binary form, which recovers each node's
+// direction by hashing up the path once
+MerkleProof::MerkleProof(const Json::Value& subtree)
+    : MerkleProof(MerkleTree::encodeProof(subtree))
+{
+}
+
+
+
+std::string MerkleProof::asBinary() const
+{
+  std::string proof(1, static_cast<char>(kind_));
+  if (kind_ == MerkleTree::PROOF_PATH)
+    writeBranch(left_, proof);
+  else
+  {
+    proof.push_back(static_cast<char>(flags_));
+    if (flags_ & MerkleTree::SPAN_LEFT)
+      writeBranch(left_, proof);
+    if (flags_ & MerkleTree::SPAN_RIGHT)
+      writeBranch(right_, proof);
+    if (flags_ & MerkleTree::SPAN_COMMON)
+      writeNodes(common_, proof);
+  }
+
+  return proof;
+}
+
+
+
+Json::Value MerkleProof::asJSON() const
+{
+  return MerkleTree::decodeProof(asBinary());
+}
+
+
+
+// tests whether the proof is a path from the leaf of the named Record with
+// the given hash, which is the leaf itself
+bool MerkleProof::doesContain(const std::string& name,
+                              const SHA384_HASH& recordHash) const
+{
+  Walk left, right;
+  return kind_ == MerkleTree::PROOF_PATH && compare(left_, name) == 0 &&
+         left_.hash == recordHash && walk(left, right);
+}
+
+
+
+bool MerkleProof::doesContain(const RecordPtr& record) const
+{
+  return doesContain(record->getName(), record->getHash());
+}
+
+
+
+// tests whether the proof is a span whose leaves are adjacent, or at an end
+// of the tree, and bound the name, as MerkleTree::checkSpan; each branch's
+// name was read from the Record that hashes to its leaf, so the names
+// compared are the committed ones
+bool MerkleProof::doesExclude(const std::string& name) const
+{
+  bool hasLeft = flags_ & MerkleTree::SPAN_LEFT;
+  bool hasRight = flags_ & MerkleTree::SPAN_RIGHT;
+  Walk left, right;
+  if (kind_ != MerkleTree::PROOF_SPAN || (!hasLeft && !hasRight) ||
+      (hasLeft && compare(left_, name) >= 0) ||
+      (hasRight && compare(right_, name) <= 0) || !walk(left, right))
+    return false;
+
+  if (hasLeft && hasRight)
+    return left.root == right.root && left.depth == right.depth &&
+           left.index + 1 == right.index;
+  if (hasLeft)
+    return left.isRightmost;
+  return right.index == 0;
+}
+
+
+
+SHA384_HASH MerkleProof::getRoot() const
+{
+  Walk left, right;
+  if (!walk(left, right) ||
+      (kind_ == MerkleTree::PROOF_SPAN && flags_ == 0))
+  {
+    SHA384_HASH root;
+    root.fill(0);
+    return root;
+  }
+
+  if (kind_ == MerkleTree::PROOF_SPAN && !(flags_ & MerkleTree::SPAN_LEFT))
+    return right.root;
+  return left.root;
+}
+
+
+
+// ************************** PRIVATE METHODS **************************** //
+
+
+
+void MerkleProof::parse(const std::string& proof)
+{
+  auto pos = reinterpret_cast<const uint8_t*>(proof.data());
+  auto end = pos + proof.size();
+  if (pos == end)
+    Log::get().error("Empty Merkle proof.");
+
+  MerkleTree::BinaryPath path;
+  kind_ = *pos++;
+  if (kind_ == MerkleTree::PROOF_PATH)
+  {
+    if (!MerkleTree::readPath(pos, end, false, path))
+      Log::get().error("Truncated or non-canonical Merkle proof.");
+    copyBranch(path, left_);
+  }
+  else if (kind_ == MerkleTree::PROOF_SPAN && pos < end)
+  {
+    flags_ = *pos++;
+    if (flags_ & ~MerkleTree::SPAN_FLAGS)
+      Log::get().error("Unknown flags in Merkle span.");
+
+    for (auto side : {MerkleTree::SPAN_LEFT, MerkleTree::SPAN_RIGHT})
+    {
+      if (!(flags_ & side))
+        continue;
+      if (!MerkleTree::readPath(pos, end, true, path))
+        Log::get().error("Truncated or non-canonical Merkle proof.");
+      copyBranch(path, side == MerkleTree::SPAN_LEFT ? left_ : right_);
+    }
+
+    if (flags_ & MerkleTree::SPAN_COMMON)
+    {
+      if (!(flags_ & MerkleTree::SPAN_LEFT) ||
+          !(flags_ & MerkleTree::SPAN_RIGHT) ||
+          !MerkleTree::readNodes(pos, end, path))
+        Log::get().error("Invalid Merkle span.");
+      copyNodes(path, common_);
+    }
+  }
+  else
+    Log::get().error("Unknown type of Merkle proof.");
+
+  if (pos != end)
+    Log::get().error("Trailing bytes after Merkle proof.");
+}
+
+
+
+void MerkleProof::copyBranch(const MerkleTree::BinaryPath& path,
+                             Branch& branch)
+{
+  branch.nameLen = static_cast<uint8_t>(path.nameLen);
+  memcpy(branch.name.data(), path.name, path.nameLen);
+  if (path.record)
+  {
+    branch.record.assign(reinterpret_cast<const char*>(path.record),
+                         path.recordLen);
+    branch.hash = MultiSHA384::hash(path.record, path.recordLen);
+  }
+  else
+    memcpy(branch.hash.data(), path.hash, Const::SHA384_LEN);
+  copyNodes(path, branch.nodes);
+}
+
+
+
+// unpacks the bitmaps and places each sibling at its level
+void MerkleProof::copyNodes(const MerkleTree::BinaryPath& path, Nodes& nodes)
+{
+  nodes.depth = static_cast<uint8_t>(path.depth);
+  nodes.directions = nodes.selfPaired = 0;
+  for (size_t j = 0; j < (path.depth + 7) / 8; j++)
+  {
+    nodes.directions |= uint64_t(path.directions[j]) << (8 * j);
+    nodes.selfPaired |= uint64_t(path.selfPaired[j]) << (8 * j);
+  }
+
+  const uint8_t* sibling = path.siblings;
+  for (size_t level = 0; level < path.depth; level++)
+    if (!(nodes.selfPaired >> level & 1))
+    {
+      memcpy(nodes.siblings[level].data(), sibling, Const::SHA384_LEN);
+      sibling += Const::SHA384_LEN;
+    }
+}
+
+
+
+// writes the branch as MerkleTree::encodePath or encodeBranch does
+void MerkleProof::writeBranch(const Branch& branch, std::string& out)
+{
+  if (branch.record.empty())
+  {
+    out.push_back(static_cast<char>(branch.nameLen));
+    out.append(branch.name.data(), branch.nameLen);
+    out.append(reinterpret_cast<const char*>(branch.hash.data()),
+               Const::SHA384_LEN);
+  }
+  else
+  {
+    out.push_back(static_cast<char>(branch.record.size() >> 8));
+    out.push_back(static_cast<char>(branch.record.size() & 0xff));
+    out += branch.record;
+  }
+
+  writeNodes(branch.nodes, out);
+}
+
+
+
+// writes the nodes as MerkleTree::encodeNodes does
+void MerkleProof::writeNodes(const Nodes& nodes, std::string& out)
+{
+  out.push_back(static_cast<char>(nodes.depth));
+  for (auto bits : {nodes.directions, nodes.selfPaired})
+    for (size_t j = 0; j < (nodes.depth + 7u) / 8; j++)
+      out.push_back(static_cast<char>(bits >> (8 * j) & 0xff));
+
+  for (size_t level = 0; level < nodes.depth; level++)
+    if (!(nodes.selfPaired >> level & 1))
+      out.append(reinterpret_cast<const char*>(nodes.siblings[level].data()),
+                 Const::SHA384_LEN);
+}
+
+
+
+// hashes each branch up to its root as MerkleTree::walkProof does, joining
+// the branches of a span below the common nodes; a path fills only left
+bool MerkleProof::walk(Walk& left, Walk& right) const
+{
+  bool hasLeft = kind_ == MerkleTree::PROOF_PATH ||
+                 (flags_ & MerkleTree::SPAN_LEFT);
+  bool hasRight = flags_ & MerkleTree::SPAN_RIGHT;
+
+  SHA384_HASH hash;
+  if (hasLeft)
+  {
+    startWalk(left_, left, hash);
+    if (!walkNodes(left_.nodes, hash, left))
+      return false;
+  }
+
+  if (hasRight)
+  {
+    startWalk(right_, right, hash);
+    if (!walkNodes(right_.nodes, hash, right))
+      return false;
+  }
+
+  if (!(flags_ & MerkleTree::SPAN_COMMON))
+    return true;
+
+  // see MerkleTree::joinBranches and splitBranches
+  if (left.depth != right.depth || left.depth >= MAX_DEPTH ||
+      left.index != (uint64_t(1) << left.depth) - 1 || right.index != 0)
+    return false;
+
+  Walk common = left;
+  common.depth = left.depth + 1;
+  common.isRightmost = right.isRightmost;
+  hash = MultiSHA384::hash(left.root, right.root);
+  if (!walkNodes(common_, hash, common))
+    return false;
+
+  left.index = common.index;
+  right.index = common.index + 1;
+  left.depth = right.depth = common.depth;
+  left.root = right.root = common.root;
+  left.isRightmost = false;
+  right.isRightmost = common.isRightmost;
+  return true;
+}
+
+
+
+// continues the walk up from the hash through the nodes
+bool MerkleProof::walkNodes(const Nodes& nodes,
+                            SHA384_HASH& hash,
+                            Walk& walk)
+{
+  if (walk.depth + nodes.depth > MAX_DEPTH)
+    return false;
+
+  for (size_t level = 0; level < nodes.depth; level++, walk.depth++)
+  {
+    bool isRight = nodes.directions >> level & 1;
+    if (nodes.selfPaired >> level & 1)
+    {
+      if (isRight)
+        return false;  // only a left child can lack a sibling
+      hash = MultiSHA384::hash(hash, hash);
+      continue;
+    }
+
+    const SHA384_HASH& sibling = nodes.siblings[level];
+    if (isRight)
+      walk.index |= uint64_t(1) << walk.depth;
+    else
+      walk.isRightmost = false;
+
+    hash = isRight ? MultiSHA384::hash(sibling, hash)
+                   : MultiSHA384::hash(hash, sibling);
+  }
+
+  walk.root = hash;
+  return true;
+}
+
+
+
+// starts the walk at the branch's leaf
+void MerkleProof::startWalk(const Branch& branch, Walk& walk, SHA384_HASH& leaf)
+{
+  leaf = branch.hash;
+  walk.index = 0;
+  walk.depth = 0;
+  walk.isRightmost = true;
+  walk.root = leaf;
+}
+
+
+
+// orders the branch's name against the given one, without copying either
+int MerkleProof::compare(const Branch& branch, const std::string& name)
+{
+  return -name.compare(0, std::string::npos, branch.name.data(),
+                       branch.nameLen);
+}
@@ -0,0 +1,73 @@
+
+#ifndef MERKLE_PROOF_HPP
+#define MERKLE_PROOF_HPP
+
+#include "MerkleTree.hpp"
+#include "records/Record.hpp"
+#include "../Constants.hpp"
+#include <json/json.h>
+#include <string>
+#include <array>
+
+// A path or span from MerkleTree, decoded once into fixed-size arrays. The
+// checks then walk those arrays directly, so they look up no JSON members,
+// decode no base64, and make no heap allocations. JSON and the binary form of
+// MerkleTree::generateProof are converted only at construction and output.
+class MerkleProof
+{
+ public:
+  MerkleProof(const std::string&);  // binary form
+  MerkleProof(const Json::Value&);  // from generateSubtree
+  std::string asBinary() const;
+  Json::Value asJSON() const;
+
+  bool doesContain(const std::string&, const SHA384_HASH&) const;
+  bool doesContain(const RecordPtr&) const;
+  bool doesExclude(const std::string&) const;
+  SHA384_HASH getRoot() const;  // zero if the proof is broken
+
+ private:
+  static const size_t MAX_DEPTH = 64;
+  static const size_t MAX_NAME = 255;
+
+  struct Nodes
+  {  // a bit per level from the bottom, and the sibling at each level
+    uint8_t depth;
+    uint64_t directions, selfPaired;
+    std::array<SHA384_HASH, MAX_DEPTH> siblings;
+  };
+
+  struct Branch
+  {  // the leaf is the Record's hash; a branch of a span has the Record
+     // itself, which is hashed and whose name is read once, when parsed
+    uint8_t nameLen;
+    std::array<char, MAX_NAME> name;
+    SHA384_HASH hash;
+    std::string record;  // empty for a path
+    Nodes nodes;
+  };
+
+  struct Walk
+  {  // where a branch's leaf sits, as MerkleTree::PathInfo
+    uint64_t index;
+    size_t depth;
+    bool isRightmost;
+    SHA384_HASH root;
+  };
+
+  void parse(const std::string&);
+  static void copyBranch(const MerkleTree::BinaryPath&, Branch&);
+  static void copyNodes(const MerkleTree::BinaryPath&, Nodes&);
+  static void writeBranch(const Branch&, std::string&);
+  static void writeNodes(const Nodes&, std::string&);
+  bool walk(Walk&, Walk&) const;
+  static bool walkNodes(const Nodes&, SHA384_HASH&, Walk&);
+  static void startWalk(const Branch&, Walk&, SHA384_HASH&);
+  static int compare(const Branch&, const std::string&);
+
+  uint8_t kind_, flags_;  // as in the binary form
+  Branch left_, right_;   // a path has only left_
+  Nodes common_;
+};
+
+#endif
@@ -1,51 +1,426 @@
 
 #include "MerkleTree.hpp"
 #include "../Log.hpp"
-#include <botan/sha2_64.h>
+#include "../crypto/MultiSHA384.hpp"
 #include <botan/base64.h>
+#include <algorithm>
+#include <exception>
+#include <thread>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 
 // records must be sorted by name
 MerkleTree::MerkleTree(const std::vector<RecordPtr>& records)
+    : nameOffsets_(nullptr),
+      nameBlob_(nullptr),
+      proofCache_(DEFAULT_PROOF_CACHE)
 {
   Log::get().notice("Building Merkle tree of size " +
                     std::to_string(records.size()));
 
-  std::vector<NodePtr> row;
+  names_.reserve(records.size());
   for (auto r : records)
+    names_.push_back(r->getName());
+  records_ = records;
+
+  // each leaf hash serializes its Record, so this pass dominates the build
+  levels_.emplace_back(records.size());
+  auto& leaves = levels_[0];
+  parallelFor(records.size(), [&records, &leaves](size_t begin, size_t end)
+              {
+                for (size_t j = begin; j < end; j++)
+                  leaves[j] = records[j]->getHash();
+              });
+
+  buildLevels();
+  Log::get().notice("Built tree. Root is " + encode(rootHash_));
+}
+
+
+
+// maps a file written by save(), which must hold the given number of leaves;
+// nothing is rehashed, so the levels are trusted to match the stored root
+MerkleTree::MerkleTree(const std::string& path, size_t count)
+    : nameOffsets_(nullptr),
+      nameBlob_(nullptr),
+      proofCache_(DEFAULT_PROOF_CACHE)
+{
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    Log::get().error("Cannot open Merkle tree " + path);
+
+  struct stat info;
+  if (fstat(fd, &info) != 0 ||
+      static_cast<size_t>(info.st_size) < sizeof(FileHeader))
+  {
+    close(fd);
+    Log::get().error("Truncated Merkle tree " + path);
+  }
+
+  size_t fileSize = static_cast<size_t>(info.st_size);
+  void* addr = mmap(nullptr, fileSize, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);  // the mapping keeps the file open
+  if (addr == MAP_FAILED)
+    Log::get().error("Cannot map Merkle tree " + path);
+  mapping_ = std::shared_ptr<const uint8_t>(
+      static_cast<const uint8_t*>(addr), [fileSize](const uint8_t* base)
+      {
+        munmap(const_cast<uint8_t*>(base), fileSize);
+      });
+
+  FileHeader header;
+  memcpy(&header, mapping_.get(), sizeof(header));
+  if (header.magic != FILE_MAGIC || header.version != FILE_VERSION)
+    Log::get().error("Unknown Merkle tree format in " + path);
+  if (header.leafCount != count)
+    Log::get().error("Merkle tree " + path + " has " +
+                     std::to_string(header.leafCount) + " leaves, expected " +
+                     std::to_string(count));
+
+  // each level halves the one below, as in buildLevels
+  size_t offset = sizeof(FileHeader);
+  for (size_t width = count;; width = (width + 1) / 2)
+  {
+    if (width > (fileSize - offset) / Const::SHA384_LEN)
+      Log::get().error("Truncated Merkle tree " + path);
+
+    Row row;
+    row.hashes =
+        reinterpret_cast<const SHA384_HASH*>(mapping_.get() + offset);
+    row.size = width;
+    rows_.push_back(row);
+    offset += width * Const::SHA384_LEN;
+    if (width <= 1)
+      break;
+  }
+
+  if (rows_.size() != header.levelCount ||
+      (fileSize - offset) / sizeof(uint64_t) <= count ||
+      fileSize - offset - (count + 1) * sizeof(uint64_t) != header.namesSize)
+    Log::get().error("Corrupt Merkle tree " + path);
+
+  // offsets must stay within the names, and the names must be strictly
+  // sorted, as every lookup and exclusion proof relies on both
+  nameOffsets_ = reinterpret_cast<const uint64_t*>(mapping_.get() + offset);
+  nameBlob_ = reinterpret_cast<const char*>(mapping_.get() + offset +
+                                            (count + 1) * sizeof(uint64_t));
+  if (nameOffsets_[0] != 0 || nameOffsets_[count] != header.namesSize)
+    Log::get().error("Corrupt Merkle tree " + path);
+  size_t previousLen = 0;
+  for (size_t j = 0; j < count; j++)
+  {
+    if (nameOffsets_[j] > nameOffsets_[j + 1])
+      Log::get().error("Corrupt Merkle tree " + path);
+
+    // compared in place against the previous name, as std::string orders
+    size_t len = nameOffsets_[j + 1] - nameOffsets_[j];
+    if (j > 0)
+    {
+      int order = std::string::traits_type::compare(
+          nameBlob_ + nameOffsets_[j - 1], nameBlob_ + nameOffsets_[j],
+          std::min(previousLen, len));
+      if (order > 0 || (order == 0 && previousLen >= len))
+        Log::get().error("Merkle tree " + path + " is out of order at " +
+                         getName(j));
+    }
+    previousLen = len;
+  }
+
+  SHA384_HASH top;
+  if (rows_.back().size == 1)
+    top = rows_.back().hashes[0];
+  else
+    top.fill(0);  // as for an empty tree
+  memcpy(rootHash_.data(), header.root, Const::SHA384_LEN);
+  if (top != rootHash_)
+    Log::get().error("Merkle tree " + path + " does not match its root");
+
+  Log::get().notice("Mapped Merkle tree of " + std::to_string(count) +
+                    " leaves from " + path + ". Root is " + encode(rootHash_));
+}
+
+
+
+// writes the levels and names to a file that can be mapped back without any
+// hashing, replacing any previous file atomically
+void MerkleTree::save(const std::string& path) const
+{
+  size_t count = getSize();
+  std::vector<uint64_t> offsets(1, 0);
+  offsets.reserve(count + 1);
+  for (size_t j = 0; j < count; j++)
+    offsets.push_back(offsets.back() + getName(j).size());
+
+  FileHeader header;
+  memset(&header, 0, sizeof(header));
+  header.magic = FILE_MAGIC;
+  header.version = FILE_VERSION;
+  header.levelCount = static_cast<uint32_t>(rows_.size());
+  header.leafCount = count;
+  header.namesSize = offsets.back();
+  memcpy(header.root, rootHash_.data(), Const::SHA384_LEN);
+
+  std::string tmpPath = path + ".tmp";
+  int fd = ::open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  if (fd < 0)
+    Log::get().error("Cannot open Merkle tree " + tmpPath);
+
+  bool success = writeAll(fd, &header, sizeof(header));
+  for (const auto& row : rows_)
+    success = success &&
+              writeAll(fd, row.hashes, row.size * Const::SHA384_LEN);
+  success = success &&
+            writeAll(fd, offsets.data(), offsets.size() * sizeof(uint64_t));
+
+  std::string names;
+  for (size_t j = 0; j < count && success; j++)
+  {
+    names += getName(j);
+    if (names.size() >= 1 << 20 || j + 1 == count)
+    {
+      success = writeAll(fd, names.data(), names.size());
+      names.clear();
+    }
+  }
+
+  success = success && fdatasync(fd) == 0;
+  close(fd);
+  if (!success)
+    Log::get().error("Failed to write Merkle tree " + tmpPath);
+  if (std::rename(tmpPath.c_str(), path.c_str()) != 0)
+    Log::get().error("Failed to replace Merkle tree " + path);
+
+  Log::get().notice("Wrote Merkle tree of " + std::to_string(count) +
+                    " leaves to " + path);
+}
+
+
+
+// adds the Record's leaf, or replaces the leaf of the same name
+void MerkleTree::insert(const RecordPtr& record)
+{
+  insert(std::vector<RecordPtr>{record});
+}
+
+
+
+// adds or replaces a batch of leaves, then rehashes each dirty ancestor once;
+// replacements cost O(log n) hashes each, but since leaves are positional, a
+// new name shifts every leaf after it, so it also rehashes that suffix
+void MerkleTree::insert(const std::vector<RecordPtr>& records)
+{
+  materialize();
+
+  auto batch = sortBatch(records);
+  std::vector<size_t> replaced;
+  std::vector<RecordPtr> added;
+  for (auto r : batch)
+  {
+    auto iter = std::lower_bound(names_.begin(), names_.end(), r->getName());
+    if (iter != names_.end() && *iter == r->getName())
+    {
+      size_t index = static_cast<size_t>(iter - names_.begin());
+      levels_[0][index] = r->getHash();
+      records_[index] = r;
+      replaced.push_back(index);
+    }
+    else
+      added.push_back(r);
+  }
+
+  // merge the new leaves in with one pass, noting the first shifted position
+  size_t shifted = names_.size();
+  if (!added.empty() &&
+      (names_.empty() || names_.back() < added[0]->getName()))
+  {  // appending after the last name shifts nothing
+    for (auto r : added)
+    {
+      names_.push_back(r->getName());
+      levels_[0].push_back(r->getHash());
+      records_.push_back(r);
+    }
+  }
+  else if (!added.empty())
   {
-    LeafPtr leaf = std::make_shared<Leaf>(r, nullptr);
-    leaves_.push_back(leaf);
-    row.push_back(leaf);
+    shifted = static_cast<size_t>(std::lower_bound(names_.begin(), names_.end(),
+                                                   added[0]->getName()) -
+                                  names_.begin());
+
+    std::vector<std::string> names;
+    std::vector<SHA384_HASH> leaves;
+    std::vector<RecordPtr> merged;
+    names.reserve(names_.size() + added.size());
+    leaves.reserve(names_.size() + added.size());
+    merged.reserve(names_.size() + added.size());
+
+    size_t a = 0;
+    for (size_t j = 0; j <= names_.size(); j++)
+    {
+      while (a < added.size() &&
+             (j == names_.size() || added[a]->getName() < names_[j]))
+      {
+        names.push_back(added[a]->getName());
+        leaves.push_back(added[a]->getHash());
+        merged.push_back(added[a]);
+        a++;
+      }
+
+      if (j < names_.size())
+      {
+        names.push_back(std::move(names_[j]));
+        leaves.push_back(levels_[0][j]);
+        merged.push_back(std::move(records_[j]));
+      }
+    }
+
+    names_.swap(names);
+    levels_[0].swap(leaves);
+    records_.swap(merged);
   }
 
-  rootHash_ = buildTree(row);
-  Log::get().notice("Built tree. Root is " +
-                    Botan::base64_encode(rootHash_.data(), Const::SHA384_LEN));
+  rehash(std::move(replaced), shifted);
 }
 
 
 
 Json::Value MerkleTree::generateSubtree(const std::string& domain) const
 {
-  if (leaves_.empty())
+  if (getSize() == 0)
   {
     Json::Value empty;
     return empty;
   }
 
-  LeafPtr needle = std::make_shared<Leaf>(domain);
-  auto lowerBound =
-      std::lower_bound(leaves_.begin(), leaves_.end(), needle, isLessThan);
+  bool found;
+  size_t index = findName(domain, found);
 
-  Log::get().notice("Lower bound on domain at " +
-                    std::to_string(lowerBound - leaves_.begin()));
+  Log::get().notice("Lower bound on domain at " + std::to_string(index));
 
   Json::Value result;
-  if (lowerBound != leaves_.end() && !isLessThan(needle, *lowerBound))
-    result = generatePath(*lowerBound);  // found, so return single path
+  if (found)
+    result = generatePath(index, rows_.size() - 1);  // found, so one path
+  else
+    result = generateSpan(index);  // not found, so return span
+
+  return result;
+}
+
+
+
+// the binary equivalent of generateSubtree; popular names are proven many
+// times under each root, so their proofs are cached until the root changes
+std::string MerkleTree::generateProof(const std::string& domain) const
+{
+  std::string proof;
+  if (getSize() == 0 || proofCache_.lookup(rootHash_, domain, proof))
+    return proof;
+
+  bool found;
+  size_t index = findName(domain, found);
+  size_t depth = rows_.size() - 1;
+  if (found)
+  {
+    proof.push_back(static_cast<char>(PROOF_PATH));
+    encodePath(index, depth, proof);
+  }
+  else if (index == 0 || index == getSize())
+  {  // a single branch at either end of the tree
+    proof.push_back(static_cast<char>(PROOF_SPAN));
+    proof.push_back(static_cast<char>(index > 0 ? SPAN_LEFT : SPAN_RIGHT));
+    encodeBranch(index > 0 ? index - 1 : index, depth, proof);
+  }
   else
-    result = generateSpan(needle, lowerBound);  // not found, so return span
+  {  // see generateSpan
+    size_t height = getJoinLevel(index - 1);
+    proof.push_back(static_cast<char>(PROOF_SPAN));
+    proof.push_back(static_cast<char>(SPAN_LEFT | SPAN_RIGHT | SPAN_COMMON));
+    encodeBranch(index - 1, height - 1, proof);
+    encodeBranch(index, height - 1, proof);
+    encodeNodes(index, height, depth, proof);
+  }
+
+  proofCache_.store(rootHash_, domain, proof);
+  return proof;
+}
+
+
+
+// proves every name at once, each by its own leaf if it is present or by
+// its bounding leaves if it is not, which carry their Records as spans do;
+// with the leaf count, the revealed leaves fix which nodes the verifier can
+// compute, so only the siblings it cannot are listed, level by level and
+// from left to right. Nodes above the names are shared, so the proof grows
+// slower than the number of names
+Json::Value MerkleTree::generateMultiproof(
+    const std::vector<std::string>& domains) const
+{
+  Json::Value result;
+  if (getSize() == 0)
+    return result;
+
+  Log::get().notice("Generating multiproof of " +
+                    std::to_string(domains.size()) + " names.");
+
+  std::vector<size_t> known, bounds;
+  for (const auto& domain : domains)
+  {
+    bool found;
+    size_t index = findName(domain, found);
+    if (found)
+      known.push_back(index);
+    else
+    {
+      if (index > 0)
+        bounds.push_back(index - 1);
+      if (index < getSize())
+        bounds.push_back(index);
+    }
+  }
+
+  std::sort(bounds.begin(), bounds.end());
+  bounds.erase(std::unique(bounds.begin(), bounds.end()), bounds.end());
+  known.insert(known.end(), bounds.begin(), bounds.end());
+  std::sort(known.begin(), known.end());
+  known.erase(std::unique(known.begin(), known.end()), known.end());
+
+  result["size"] = static_cast<Json::UInt64>(getSize());
+  result["leaves"] = Json::Value(Json::arrayValue);
+  for (auto index : known)
+  {
+    Json::Value leafVal;
+    if (std::binary_search(bounds.begin(), bounds.end(), index))
+      leafVal["record"] = getRecord(index)->asJSON();
+    else
+    {
+      leafVal["name"] = getName(index);
+      leafVal["hash"] = encode(rows_[0].hashes[index]);
+    }
+    leafVal["index"] = static_cast<Json::UInt64>(index);
+    result["leaves"].append(leafVal);
+  }
+
+  // known nodes stay sorted, and a parent is known if either child is
+  Json::Value& hashes = result["hashes"] = Json::Value(Json::arrayValue);
+  for (size_t level = 0; level + 1 < rows_.size(); level++)
+  {
+    const Row& row = rows_[level];
+    std::vector<size_t> parents;
+    for (size_t k = 0; k < known.size(); k++)
+    {
+      size_t j = known[k];
+      if (!(j & 1) && k + 1 < known.size() && known[k + 1] == j + 1)
+        k++;  // both children are known
+      else if ((j ^ 1) < row.size)
+        hashes.append(encode(row.hashes[j ^ 1]));
+      parents.push_back(j / 2);
+    }
+
+    known.swap(parents);
+  }
 
   return result;
 }
@@ -56,9 +431,10 @@ Json::Value MerkleTree::generateSubtree(const std::string& domain) const
 bool MerkleTree::doesContain(const Json::Value& subtree,
                              const RecordPtr& record)
 {
+  PathInfo info;
   if (subtree.isArray())
   {  // check main path
-    if (!verifyPath(subtree, record))
+    if (!verifyPath(subtree, record, info, nullptr))
       return false;
   }
   else
@@ -70,8 +446,9 @@ bool MerkleTree::doesContain(const Json::Value& subtree,
     if (subtree.isMember("left") || subtree.isMember("right"))
     {
       // verify each path's validity, then check if the span covers the Record
-      if (!verifyPath(subtree["left"], record) ||
-          !verifyPath(subtree["right"], record) || !verifySpan(subtree, record))
+      if (!verifyPath(subtree["left"], record, info, nullptr) ||
+          !verifyPath(subtree["right"], record, info, nullptr) ||
+          !verifySpan(subtree, record->getName(), info, nullptr))
         return false;
     }
     else
@@ -83,40 +460,74 @@ bool MerkleTree::doesContain(const Json::Value& subtree,
 
 
 
-SHA384_HASH MerkleTree::extractRoot(const Json::Value& subtree)
+// tests whether the span proves that the name is not in the tree
+bool MerkleTree::doesExclude(const Json::Value& subtree,
+                             const std::string& name)
 {
-  std::string base64Root;
+  PathInfo info;
+  return verifySpan(subtree, name, info, nullptr);
+}
 
-  // extract base64-encoded string
-  if (subtree.isArray())
-  {  // extract root from single path
-    base64Root = subtree[subtree.size() - 1]["hash"].asString();
-  }
-  else
-  {  // extract from a branch from the span
 
-    // https://stackoverflow.com/questions/1596668
-    if (subtree.isMember("left") != subtree.isMember("right"))
-      Log::get().warn("Malformed Merkle subtree, incomplete span.");
 
-    if (subtree.isMember("left"))
-    {
-      Json::Value leftPath = subtree["left"];
-      base64Root = leftPath[leftPath.size() - 1]["hash"].asString();
-    }
-    else
-      Log::get().warn("Subtree is missing both branches!");
-  }
+SHA384_HASH MerkleTree::extractRoot(const Json::Value& subtree)
+{
+  if (subtree.isArray())
+    return extractPathRoot(subtree);  // extract root from single path
 
   SHA384_HASH root;
-  if (Botan::base64_decode(root.data(), base64Root) != Const::SHA384_LEN)
-    Log::get().warn("Invalid root size for Merkle subtree.");
+  root.fill(0);
+  if (subtree.isMember("common"))
+  {  // the common path ends at the root, unless the branches meet there
+    const Json::Value& common = subtree["common"];
+    if (common.isArray() && common.empty())
+      return concatenateHashes(extractPathRoot(subtree["left"]),
+                               extractPathRoot(subtree["right"]));
+    if (!common.isArray() || !hashNode(common[common.size() - 1], root))
+      Log::get().warn("Invalid common path in Merkle span.");
+    return root;
+  }
+
+  // extract from a branch from the span
+  if (subtree.isMember("left"))
+    return extractPathRoot(subtree["left"]);
+  if (subtree.isMember("right"))
+    return extractPathRoot(subtree["right"]);
 
+  Log::get().warn("Subtree is missing both branches!");
   return root;
 }
 
 
 
+// the Records in order of name, keeping only the last Record of any name, as
+// both insert() and VersionedMerkleTree apply batches
+std::vector<RecordPtr> MerkleTree::sortBatch(
+    const std::vector<RecordPtr>& records)
+{
+  std::vector<RecordPtr> batch(records);
+  std::stable_sort(batch.begin(), batch.end(),
+                   [](const RecordPtr& a, const RecordPtr& b)
+                   {
+                     return a->getName() < b->getName();
+                   });
+
+  size_t kept = 0;
+  for (size_t j = 0; j < batch.size(); j++)
+  {
+    if (j + 1 < batch.size() &&
+        batch[j]->getName() == batch[j + 1]->getName())
+      continue;  // superseded
+    if (kept != j)
+      batch[kept] = std::move(batch[j]);
+    kept++;
+  }
+  batch.resize(kept);
+  return batch;
+}
+
+
+
 SHA384_HASH MerkleTree::getRootHash() const
 {
   return rootHash_;
@@ -124,231 +535,1481 @@ SHA384_HASH MerkleTree::getRootHash() const
 
 
 
-// ************************** PRIVATE METHODS **************************** //
+// the number of leaves
+size_t MerkleTree::getSize() const
+{
+  return rows_[0].size;
+}
+
+
+
+void MerkleTree::setProofCacheSize(size_t bytes)
+{
+  proofCache_.setCapacity(bytes);
+}
+
 
 
+Json::Value MerkleTree::getProofCacheStats() const
+{
+  return proofCache_.getStats();
+}
+
+
+
+void MerkleTree::setRecordSource(const RecordSource& source)
+{
+  recordSource_ = source;
+}
+
 
-SHA384_HASH MerkleTree::buildTree(std::vector<NodePtr>& row)
+
+// converts a path or span from generateSubtree into its binary form
+std::string MerkleTree::encodeProof(const Json::Value& subtree)
 {
-  // build breadth-first, row by row
-  while (row.size() > 1)
+  std::string proof;
+  if (subtree.isArray())
+  {
+    SHA384_HASH root;
+    proof.push_back(static_cast<char>(PROOF_PATH));
+    encodePath(subtree, false, root, proof);
+  }
+  else if (subtree.isMember("left") || subtree.isMember("right"))
   {
-    std::vector<NodePtr> nextRow;
-    for (size_t j = 0; j < row.size(); j += 2)
+    uint8_t flags = (subtree.isMember("left") ? SPAN_LEFT : 0) |
+                    (subtree.isMember("right") ? SPAN_RIGHT : 0) |
+                    (subtree.isMember("common") ? SPAN_COMMON : 0);
+    if ((flags & SPAN_COMMON) && !((flags & SPAN_LEFT) && (flags & SPAN_RIGHT)))
+      Log::get().error("Invalid Merkle span.");
+
+    proof.push_back(static_cast<char>(PROOF_SPAN));
+    proof.push_back(static_cast<char>(flags));
+    SHA384_HASH leftTop, rightTop;
+    if (flags & SPAN_LEFT)
+      encodePath(subtree["left"], true, leftTop, proof);
+    if (flags & SPAN_RIGHT)
+      encodePath(subtree["right"], true, rightTop, proof);
+    if (flags & SPAN_COMMON)
     {
-      // get left and right, or get left twice if row size is odd
-      NodePtr left = row[j + 0];
-      NodePtr right = j + 1 < row.size() ? row[j + 1] : left;
+      SHA384_HASH hash = concatenateHashes(leftTop, rightTop);
+      encodeNodes(subtree["common"], 0, hash, proof);
+    }
+  }
 
-      SHA384_HASH hash = concatenateHashes(left, right);
-      NodePtr node = std::make_shared<Node>(nullptr, hash);
+  return proof;
+}
 
-      nextRow.push_back(node);
-      node->setChildren(left, j + 1 < row.size() ? right : nullptr);
-      left->setParent(node);
-      right->setParent(node);
-    }
 
-    row = nextRow;
+
+// expands a binary proof into the JSON of generateSubtree, which can then be
+// checked with doesContain, doesExclude, and extractRoot
+Json::Value MerkleTree::decodeProof(const std::string& proof)
+{
+  auto pos = reinterpret_cast<const uint8_t*>(proof.data());
+  auto end = pos + proof.size();
+
+  Json::Value subtree;
+  if (pos == end)
+    return subtree;
+
+  SHA384_HASH root;
+  uint8_t kind = *pos++;
+  if (kind == PROOF_PATH)
+    subtree = decodePath(pos, end, false, root);
+  else if (kind == PROOF_SPAN && pos < end)
+  {
+    uint8_t flags = *pos++;
+    if (flags & ~SPAN_FLAGS)
+      Log::get().error("Unknown flags in Merkle span.");
+
+    SHA384_HASH leftTop, rightTop;
+    if (flags & SPAN_LEFT)
+      subtree["left"] = decodePath(pos, end, true, leftTop);
+    if (flags & SPAN_RIGHT)
+      subtree["right"] = decodePath(pos, end, true, rightTop);
+    if (flags & SPAN_COMMON)
+    {
+      BinaryPath common;
+      if (!(flags & SPAN_LEFT) || !(flags & SPAN_RIGHT) ||
+          !readNodes(pos, end, common))
+        Log::get().error("Invalid Merkle span.");
+
+      SHA384_HASH hash = concatenateHashes(leftTop, rightTop);
+      subtree["common"] = Json::Value(Json::arrayValue);
+      decodeNodes(common, hash, subtree["common"]);
+    }
   }
+  else
+    Log::get().error("Unknown type of Merkle proof.");
 
-  return row[0]->getHash();
+  if (pos != end)
+    Log::get().error("Trailing bytes after Merkle proof.");
+  return subtree;
 }
 
 
 
-// returns a hash of the two nodes' values
-SHA384_HASH MerkleTree::concatenateHashes(const NodePtr& a, const NodePtr& b)
+// verifies a binary proof directly, without expanding it into JSON
+bool MerkleTree::doesContain(const std::string& proof, const RecordPtr& record)
 {
-  // hash their concatenation
-  Botan::SHA_384 sha384;
+  ProofInfo info;
+  return walkProof(proof, info, nullptr) && info.kind == PROOF_PATH &&
+         info.left.name == record->getName() &&
+         info.left.hash == record->getHash();
+}
+
+
 
-  std::array<uint8_t, 2 * Const::SHA384_LEN> concat;
-  memcpy(concat.data(), a->getHash().data(), Const::SHA384_LEN);
-  memcpy(concat.data() + Const::SHA384_LEN, b->getHash().data(),
-         Const::SHA384_LEN);
+bool MerkleTree::doesExclude(const std::string& proof, const std::string& name)
+{
+  ProofInfo info;
+  return walkProof(proof, info, nullptr) && info.kind == PROOF_SPAN &&
+         checkSpan(info.hasLeft ? &info.left : nullptr,
+                   info.hasRight ? &info.right : nullptr, name);
+}
 
-  SHA384_HASH result;
-  auto hash = sha384.process(concat.data(), concat.size());
-  memcpy(result.data(), hash, hash.size());
 
-  Log::get().notice(std::to_string(hash.size()) + " | " +
-                    std::to_string(Const::SHA384_LEN));
 
-  return result;
+SHA384_HASH MerkleTree::extractRoot(const std::string& proof)
+{
+  ProofInfo info;
+  if (walkProof(proof, info, nullptr) && (info.hasLeft || info.hasRight))
+    return info.hasLeft ? info.left.root : info.right.root;
+
+  Log::get().warn("Invalid binary Merkle proof.");
+  SHA384_HASH empty;
+  empty.fill(0);
+  return empty;
 }
 
 
 
-Json::Value MerkleTree::generatePath(const LeafPtr& leaf) const
+// checks that the multiproof holds each Record and shows that each name is
+// absent, and sets root to the root that it leads to
+bool MerkleTree::doesProve(const Json::Value& multiproof,
+                           const std::vector<RecordPtr>& records,
+                           const std::vector<std::string>& missing,
+                           SHA384_HASH& root)
 {
-  Log::get().notice("Generating single path through Merkle tree.");
+  std::vector<PathInfo> leaves;
+  size_t size;
+  return walkMultiproof(multiproof, leaves, size, root, nullptr) &&
+         checkMultiproof(leaves, size, records, missing);
+}
 
-  Json::Value result;
 
-  Json::Value leafVal;
-  leafVal["name"] = leaf->getName();
-  leafVal["hash"] = leaf->getBase64Hash();
-  result.append(leafVal);
 
-  NodePtr node = leaf->getParent();
-  while (node)
-  {
-    result.append(node->asValue());
-    node = node->getParent();
-  }
+MerkleTree::Verifier::Verifier(const SHA384_HASH& root) : root_(root)
+{
+}
 
-  return result;
+
+
+bool MerkleTree::Verifier::doesContain(const Json::Value& path,
+                                       const RecordPtr& record)
+{
+  PathInfo info;
+  return verifyPath(path, record, info, &memo_) && info.root == root_;
 }
 
 
 
-Json::Value MerkleTree::generateSpan(
-    const LeafPtr& needle,
-    const std::vector<LeafPtr>::const_iterator& lowerBound) const
+bool MerkleTree::Verifier::doesExclude(const Json::Value& subtree,
+                                       const std::string& name)
 {
-  Log::get().notice("Generating span through Merkle tree.");
+  PathInfo info;
+  return verifySpan(subtree, name, info, &memo_) && info.root == root_;
+}
+
 
-  auto upperBound =
-      std::upper_bound(leaves_.begin(), leaves_.end(), needle, isLessThan);
 
-  Json::Value lowerPath = generatePath(*lowerBound);
-  Json::Value upperPath = generatePath(*upperBound);
+bool MerkleTree::Verifier::doesContain(const std::string& proof,
+                                       const RecordPtr& record)
+{
+  ProofInfo info;
+  return walkProof(proof, info, &memo_) && info.kind == PROOF_PATH &&
+         info.left.root == root_ && info.left.name == record->getName() &&
+         info.left.hash == record->getHash();
+}
 
-  // todo: return "common" path where the two paths converge
 
-  Json::Value result;
-  result["left"] = lowerPath;
-  result["right"] = upperPath;
-  return result;
+
+bool MerkleTree::Verifier::doesExclude(const std::string& proof,
+                                       const std::string& name)
+{
+  ProofInfo info;
+  return walkProof(proof, info, &memo_) && info.kind == PROOF_SPAN &&
+         checkSpan(info.hasLeft ? &info.left : nullptr,
+                   info.hasRight ? &info.right : nullptr, name) &&
+         (info.hasLeft ? info.left.root : info.right.root) == root_;
 }
 
 
 
-// checks the cryptographic validity of the paths to the Record
-bool MerkleTree::verifyPath(const Json::Value& path, const RecordPtr& record)
+bool MerkleTree::Verifier::doesProve(const Json::Value& multiproof,
+                                     const std::vector<RecordPtr>& records,
+                                     const std::vector<std::string>& missing)
 {
-  // check name
-  if (path[0]["name"] != record->getName())
-    return false;
+  std::vector<PathInfo> leaves;
+  size_t size;
+  SHA384_HASH root;
+  return walkMultiproof(multiproof, leaves, size, root, &memo_) &&
+         root == root_ && checkMultiproof(leaves, size, records, missing);
+}
+
+
+
+// the number of distinct nodes hashed so far
+size_t MerkleTree::Verifier::getHashCount() const
+{
+  return memo_.size();
+}
+
+
+
+// ************************** PRIVATE METHODS **************************** //
 
-  // check record's hash against first hash
-  Leaf leaf(record, nullptr);
-  if (path[0]["hash"] != leaf.getBase64Hash())
-    return false;
 
-  for (size_t j = 1; j < path.size(); j++)
+
+// hashes each level from the one below until a single root remains
+void MerkleTree::buildLevels()
+{
+  levels_.resize(1);
+  while (levels_.back().size() > 1)
   {
-    // todo:
-    // if previous hashes do not match either current match, return false
-    // concatenateHashes
-    // trouble is that I need the neighboring Record, yes? no
+    const auto& row = levels_.back();
+    std::vector<SHA384_HASH> nextRow((row.size() + 1) / 2);
+
+    // hash left and right, or left twice if row size is odd
+    parallelFor(nextRow.size(), [&row, &nextRow](size_t begin, size_t end)
+                {
+                  MultiSHA384::hashRow(row.data(), row.size(), nextRow.data(),
+                                       begin, end);
+                });
+
+    levels_.push_back(std::move(nextRow));
   }
 
-  return true;
+  if (levels_.back().empty())
+    rootHash_.fill(0);
+  else
+    rootHash_ = levels_.back()[0];
+  refreshRows();
 }
 
 
 
-// checks whether a span bounds the Record
-bool MerkleTree::verifySpan(const Json::Value& subtree, const RecordPtr& record)
+// recomputes the ancestors of the dirty leaves and of every leaf from the
+// shifted index onwards, one level at a time so shared ancestors hash once
+void MerkleTree::rehash(std::vector<size_t> dirty, size_t shifted)
 {
-  return subtree["left"][0]["name"].asString() < record->getName() &&
-         record->getName() < subtree["right"][0]["name"].asString();
+  size_t level = 0;
+  for (; levels_[level].size() > 1; level++)
+  {
+    if (levels_.size() == level + 1)
+      levels_.emplace_back();
+    const auto& row = levels_[level];
+    auto& nextRow = levels_[level + 1];
+    nextRow.resize((row.size() + 1) / 2);
+
+    // parents of dirty nodes, which stay in ascending order, skipping any
+    // that are already within the suffix
+    shifted /= 2;
+    std::vector<size_t> parents;
+    for (auto index : dirty)
+      if (index / 2 < shifted &&
+          (parents.empty() || parents.back() != index / 2))
+        parents.push_back(index / 2);
+
+    for (auto j : parents)
+      MultiSHA384::hashRow(row.data(), row.size(), nextRow.data(), j, j + 1);
+
+    size_t from = std::min(shifted, nextRow.size());
+    parallelFor(nextRow.size() - from,
+                [&row, &nextRow, from](size_t begin, size_t end)
+                {
+                  MultiSHA384::hashRow(row.data(), row.size(), nextRow.data(),
+                                       from + begin, from + end);
+                });
+
+    dirty.swap(parents);
+  }
+
+  levels_.resize(level + 1);
+  if (levels_.back().empty())
+    rootHash_.fill(0);
+  else
+    rootHash_ = levels_.back()[0];
+  refreshRows();
 }
 
 
 
-bool MerkleTree::isLessThan(const LeafPtr& a, const LeafPtr& b)
+// points rows_ at levels_, which are reallocated as they grow
+void MerkleTree::refreshRows()
 {
-  return a->getName() < b->getName();
+  rows_.clear();
+  for (const auto& level : levels_)
+  {
+    Row row;
+    row.hashes = level.data();
+    row.size = level.size();
+    rows_.push_back(row);
+  }
 }
 
 
 
-// ************************** SUBCLASS METHODS **************************** //
+// copies a mapped tree into memory so that it can be modified
+void MerkleTree::materialize()
+{
+  if (!mapping_)
+    return;
+
+  levels_.clear();
+  for (const auto& row : rows_)
+    levels_.emplace_back(row.hashes, row.hashes + row.size);
+
+  names_.clear();
+  names_.reserve(getSize());
+  for (size_t j = 0; j < getSize(); j++)
+    names_.push_back(getName(j));
+  records_.assign(getSize(), nullptr);  // still looked up through the source
+
+  mapping_.reset();
+  nameOffsets_ = nullptr;
+  nameBlob_ = nullptr;
+  refreshRows();
+}
 
 
 
-MerkleTree::Node::Node()
-    : parent_(nullptr), leftChild_(nullptr), rightChild_(nullptr)
+// returns the index of the first name not less than the given one, noting
+// whether it is that name
+size_t MerkleTree::findName(const std::string& name, bool& found) const
 {
-  hash_.fill(0);
+  if (!mapping_)
+  {
+    auto iter = std::lower_bound(names_.begin(), names_.end(), name);
+    found = iter != names_.end() && *iter == name;
+    return static_cast<size_t>(iter - names_.begin());
+  }
+
+  // compares against the mapped names in place
+  auto compare = [this, &name](size_t j)
+  {
+    return name.compare(0, name.size(), nameBlob_ + nameOffsets_[j],
+                        nameOffsets_[j + 1] - nameOffsets_[j]);
+  };
+
+  size_t low = 0, high = getSize();
+  while (low < high)
+  {
+    size_t mid = low + (high - low) / 2;
+    if (compare(mid) > 0)
+      low = mid + 1;
+    else
+      high = mid;
+  }
+
+  found = low < getSize() && compare(low) == 0;
+  return low;
 }
 
 
 
-MerkleTree::Node::Node(const NodePtr& parent, const SHA384_HASH& hash)
-    : parent_(parent), leftChild_(nullptr), rightChild_(nullptr), hash_(hash)
+std::string MerkleTree::getName(size_t index) const
 {
+  if (!mapping_)
+    return names_[index];
+  return std::string(nameBlob_ + nameOffsets_[index],
+                     nameOffsets_[index + 1] - nameOffsets_[index]);
 }
 
 
 
-void MerkleTree::Node::setParent(const NodePtr& parent)
+// the leaf's Record, which must still hash to the leaf
+RecordPtr MerkleTree::getRecord(size_t index) const
 {
-  parent_ = parent;
+  RecordPtr record;
+  if (!mapping_ && records_[index])
+    record = records_[index];
+  else if (recordSource_)
+    record = recordSource_(getName(index));
+
+  if (!record || record->getName() != getName(index) ||
+      record->getHash() != rows_[0].hashes[index])
+    Log::get().error("No Record of " + getName(index) +
+                     " to prove its neighbours with.");
+  return record;
 }
 
 
 
-void MerkleTree::Node::setChildren(const NodePtr& left, const NodePtr& right)
+bool MerkleTree::writeAll(int fd, const void* data, size_t size)
 {
-  leftChild_ = left;
-  rightChild_ = right;
+  auto bytes = static_cast<const char*>(data);
+  size_t written = 0;
+  while (written < size)
+  {
+    ssize_t n = write(fd, bytes + written, size - written);
+    if (n < 0)
+      return false;
+    written += static_cast<size_t>(n);
+  }
+
+  return true;
 }
 
 
 
-MerkleTree::NodePtr MerkleTree::Node::getParent() const
+SHA384_HASH MerkleTree::concatenateHashes(const SHA384_HASH& a,
+                                          const SHA384_HASH& b)
 {
-  return parent_;
+  return MultiSHA384::hash(a, b);  // of their concatenation
 }
 
 
 
-SHA384_HASH MerkleTree::Node::getHash() const
+// the leaf followed by its ancestors up to the given level
+Json::Value MerkleTree::generatePath(size_t index, size_t depth) const
 {
-  return hash_;
+  Log::get().notice("Generating single path through Merkle tree.");
+
+  Json::Value result;
+
+  Json::Value leafVal;
+  leafVal["name"] = getName(index);
+  leafVal["hash"] = encode(rows_[0].hashes[index]);
+  result.append(leafVal);
+
+  appendNodes(index, 0, depth, result);
+  return result;
 }
 
 
 
-std::string MerkleTree::Node::getBase64Hash() const
+// as above, but the leaf is given as its Record, from which the verifier
+// recomputes both the leaf and its name
+Json::Value MerkleTree::generateBranch(size_t index, size_t depth) const
 {
-  return Botan::base64_encode(hash_.data(), Const::SHA384_LEN);
+  Json::Value result;
+
+  Json::Value leafVal;
+  leafVal["record"] = getRecord(index)->asJSON();
+  result.append(leafVal);
+
+  appendNodes(index, 0, depth, result);
+  return result;
 }
 
 
 
-Json::Value MerkleTree::Node::asValue() const
+// lowerBound is the index of the first leaf after the missing name, so it and
+// its predecessor bound the name; either is omitted at the ends of the tree.
+// If both are given, their paths stop below their lowest common ancestor,
+// whose hash follows from their tops, and "common" continues from there to
+// the root, so the shared part is sent and hashed only once
+Json::Value MerkleTree::generateSpan(size_t lowerBound) const
 {
-  Json::Value value;
+  Log::get().notice("Generating span through Merkle tree.");
 
-  if (leftChild_)
-    value["left"] = leftChild_->getBase64Hash();
-  if (rightChild_)
-    value["right"] = rightChild_->getBase64Hash();
+  size_t depth = rows_.size() - 1;
+  Json::Value result;
+  if (lowerBound == 0)
+    result["right"] = generateBranch(lowerBound, depth);
+  else if (lowerBound == getSize())
+    result["left"] = generateBranch(lowerBound - 1, depth);
+  else
+  {
+    size_t height = getJoinLevel(lowerBound - 1);
+    result["left"] = generateBranch(lowerBound - 1, height - 1);
+    result["right"] = generateBranch(lowerBound, height - 1);
+    result["common"] = Json::Value(Json::arrayValue);
+    appendNodes(lowerBound, height, depth, result["common"]);
+  }
 
-  return value;
+  return result;
 }
 
 
 
-MerkleTree::Leaf::Leaf(const RecordPtr& record, const NodePtr& parent)
-    : Node(parent, record->getHash()), name_(record->getName())
+// appends the ancestors of the index from the one above the from level up to
+// the one at the to level, each listing the hashes of its children
+void MerkleTree::appendNodes(size_t index,
+                             size_t from,
+                             size_t to,
+                             Json::Value& out) const
 {
+  for (size_t level = from; level < to; level++)
+  {
+    const Row& children = rows_[level];
+    size_t left = (index >> (level + 1)) << 1;
+
+    Json::Value node;
+    node["left"] = encode(children.hashes[left]);
+    if (left + 1 < children.size)
+      node["right"] = encode(children.hashes[left + 1]);
+    out.append(node);
+  }
 }
 
 
 
-MerkleTree::Leaf::Leaf(const std::string& name) : name_(name)
+// the level of the lowest common ancestor of the index and the next leaf,
+// which is where their indices stop differing
+size_t MerkleTree::getJoinLevel(size_t index)
 {
+  size_t level = 0;
+  for (size_t diff = index ^ (index + 1); diff > 0; diff >>= 1)
+    level++;
+  return level;
 }
 
 
 
-std::string MerkleTree::Leaf::getName() const
+// checks that the path starts at the Record's leaf and hashes up to its root
+bool MerkleTree::verifyPath(const Json::Value& path,
+                            const RecordPtr& record,
+                            PathInfo& info,
+                            HashMemo* memo)
 {
-  return name_;
+  if (!path.isArray() || path.empty())
+    return false;
+
+  // check name
+  if (path[0]["name"] != record->getName())
+    return false;
+
+  // check record's hash against first hash
+  if (path[0]["hash"] != encode(record->getHash()))
+    return false;
+
+  return walkPath(path, info, memo);
+}
+
+
+
+// checks that the span's leaves are valid paths to the same root, that they
+// are adjacent or at the ends of the tree, and that they bound the name; a
+// missing branch is an open bound
+bool MerkleTree::verifySpan(const Json::Value& subtree,
+                            const std::string& name,
+                            PathInfo& info,
+                            HashMemo* memo)
+{
+  if (subtree.isArray() ||
+      (!subtree.isMember("left") && !subtree.isMember("right")))
+    return false;  // not a span
+
+  PathInfo left, right;
+  bool hasLeft = subtree.isMember("left"), hasRight = subtree.isMember("right");
+  if ((hasLeft && !walkPath(subtree["left"], left, memo)) ||
+      (hasRight && !walkPath(subtree["right"], right, memo)))
+    return false;
+
+  if (subtree.isMember("common"))
+  {  // the branches stop below their shared ancestor, so walk on from it
+    PathInfo common;
+    SHA384_HASH hash;
+    if (!hasLeft || !hasRight ||
+        !joinBranches(left, right, hash, common, memo) ||
+        !walkNodes(subtree["common"], 0, hash, common, memo))
+      return false;
+    splitBranches(common, left, right);
+  }
+
+  if (!checkSpan(hasLeft ? &left : nullptr, hasRight ? &right : nullptr, name))
+    return false;
+
+  info = hasLeft ? left : right;
+  return true;
+}
+
+
+
+// checks that the walked leaves bound the name by the names in their Records,
+// and that they are adjacent leaves of the same tree, or the first or last
+// leaf if one side is missing
+bool MerkleTree::checkSpan(const PathInfo* left,
+                           const PathInfo* right,
+                           const std::string& name)
+{
+  if ((left && (!left->isBound || !(left->name < name))) ||
+      (right && (!right->isBound || !(name < right->name))))
+    return false;
+
+  if (left && right)
+    return left->root == right->root && left->depth == right->depth &&
+           left->index + 1 == right->index;
+  if (left)
+    return left->isRightmost;  // else later leaves may hold the name
+  if (right)
+    return right->index == 0;  // else earlier leaves may hold the name
+  return false;
+}
+
+
+
+// reads the revealed leaves, which must be sorted by both index and name,
+// and hashes up to the root as generateMultiproof does, taking each sibling
+// that cannot be computed from the list of hashes in turn
+bool MerkleTree::walkMultiproof(const Json::Value& multiproof,
+                                std::vector<PathInfo>& leaves,
+                                size_t& size,
+                                SHA384_HASH& root,
+                                HashMemo* memo)
+{
+  if (!multiproof.isObject() || !multiproof["size"].isUInt64() ||
+      !multiproof["leaves"].isArray() || !multiproof["hashes"].isArray())
+    return false;
+
+  size = multiproof["size"].asUInt64();
+  const Json::Value& leafVals = multiproof["leaves"];
+  const Json::Value& hashes = multiproof["hashes"];
+  if (size == 0 || leafVals.empty())
+    return false;
+
+  std::vector<std::pair<size_t, SHA384_HASH> > known;
+  for (const auto& leafVal : leafVals)
+  {
+    PathInfo leaf;
+    if (!readLeaf(leafVal, leaf) || !leafVal["index"].isUInt64())
+      return false;
+
+    leaf.index = leafVal["index"].asUInt64();
+    if (leaf.index >= size ||
+        (!leaves.empty() && (leaf.index <= leaves.back().index ||
+                             leaf.name <= leaves.back().name)))
+      return false;
+
+    known.emplace_back(leaf.index, leaf.hash);
+    leaves.push_back(std::move(leaf));
+  }
+
+  Json::ArrayIndex next = 0;
+  for (size_t width = size; width > 1; width = (width + 1) / 2)
+  {
+    std::vector<std::pair<size_t, SHA384_HASH> > parents;
+    for (size_t k = 0; k < known.size(); k++)
+    {
+      size_t j = known[k].first;
+      SHA384_HASH hash = known[k].second, sibling;
+      if (!(j & 1) && k + 1 < known.size() && known[k + 1].first == j + 1)
+        sibling = known[++k].second;
+      else if ((j ^ 1) < width)
+      {
+        if (next >= hashes.size() || !decode(hashes[next++], sibling))
+          return false;
+      }
+      else
+        sibling = hash;  // odd node, its hash was paired with itself
+
+      parents.emplace_back(j / 2, j & 1 ? hashChildren(sibling, hash, memo)
+                                        : hashChildren(hash, sibling, memo));
+    }
+
+    known.swap(parents);
+  }
+
+  root = known[0].second;
+  return next == hashes.size();
+}
+
+
+
+// checks that each Record is a revealed leaf, and that each missing name
+// falls between two adjacent revealed leaves or beyond an end of the tree.
+// Those leaves must have their names bound, either by their own Records or
+// by matching one of the given Records
+bool MerkleTree::checkMultiproof(const std::vector<PathInfo>& leaves,
+                                 size_t size,
+                                 const std::vector<RecordPtr>& records,
+                                 const std::vector<std::string>& missing)
+{
+  auto byName = [](const PathInfo& leaf, const std::string& name)
+  {
+    return leaf.name < name;
+  };
+
+  std::vector<bool> isBound;
+  for (const auto& leaf : leaves)
+    isBound.push_back(leaf.isBound);
+
+  for (auto r : records)
+  {
+    auto iter =
+        std::lower_bound(leaves.begin(), leaves.end(), r->getName(), byName);
+    if (iter == leaves.end() || iter->name != r->getName() ||
+        iter->hash != r->getHash())
+      return false;
+    isBound[static_cast<size_t>(iter - leaves.begin())] = true;
+  }
+
+  for (const auto& name : missing)
+  {
+    auto upper = std::lower_bound(leaves.begin(), leaves.end(), name, byName);
+    if (upper != leaves.end() && upper->name == name)
+      return false;
+
+    size_t j = static_cast<size_t>(upper - leaves.begin());
+    if ((j > 0 && !isBound[j - 1]) || (j < leaves.size() && !isBound[j]))
+      return false;
+
+    if (upper == leaves.begin())
+    {
+      if (upper->index != 0)
+        return false;  // else earlier leaves may hold the name
+    }
+    else if (upper == leaves.end())
+    {
+      if ((upper - 1)->index != size - 1)
+        return false;  // else later leaves may hold the name
+    }
+    else if ((upper - 1)->index + 1 != upper->index)
+      return false;
+  }
+
+  return true;
+}
+
+
+
+// checks that the branches of a span end at the two children of one node,
+// so the left leaf is the last one under that node's left child and the right
+// leaf the first under its right, and starts the common path from that node
+bool MerkleTree::joinBranches(const PathInfo& left,
+                              const PathInfo& right,
+                              SHA384_HASH& hash,
+                              PathInfo& common,
+                              HashMemo* memo)
+{
+  if (left.depth != right.depth || left.depth >= 64 ||
+      left.index != (size_t(1) << left.depth) - 1 || right.index != 0)
+    return false;
+
+  common = left;
+  common.depth = left.depth + 1;  // as the left child, its bit stays clear
+  common.isRightmost = right.isRightmost;
+  hash = hashChildren(left.root, right.root, memo);
+  return true;
+}
+
+
+
+// gives both leaves the full path walked through their common ancestor
+void MerkleTree::splitBranches(const PathInfo& common,
+                               PathInfo& left,
+                               PathInfo& right)
+{
+  left.index = common.index;
+  right.index = common.index + 1;
+  left.depth = right.depth = common.depth;
+  left.root = right.root = common.root;
+  left.isRightmost = false;
+  right.isRightmost = common.isRightmost;
+}
+
+
+
+// recomputes each node from the leaf to the root, checking that every hash is
+// one of its parent's children; whether it was the left or right child gives
+// the leaf's index, and a leaf that never had a right sibling is the last one
+bool MerkleTree::walkPath(const Json::Value& path,
+                          PathInfo& info,
+                          HashMemo* memo)
+{
+  if (!path.isArray() || path.empty() || !readLeaf(path[0], info))
+    return false;
+
+  info.index = 0;
+  info.depth = 0;
+  info.isRightmost = true;
+
+  SHA384_HASH hash = info.hash;
+  return walkNodes(path, 1, hash, info, memo);
+}
+
+
+
+// reads a leaf given as its name and hash, or as its Record, which is hashed
+// to the leaf and gives the name bound to it
+bool MerkleTree::readLeaf(const Json::Value& leafVal, PathInfo& info)
+{
+  if (!leafVal.isObject())
+    return false;
+
+  if (leafVal.isMember("record"))
+  {
+    if (!leafVal["record"].isString())
+      return false;
+
+    std::string record = leafVal["record"].asString();
+    auto bytes = reinterpret_cast<const uint8_t*>(record.data());
+    const uint8_t* name;
+    size_t nameLen;
+    if (!readRecordName(bytes, record.size(), name, nameLen))
+      return false;
+
+    info.name.assign(reinterpret_cast<const char*>(name), nameLen);
+    info.hash = MultiSHA384::hash(bytes, record.size());
+    info.isBound = true;
+    return true;
+  }
+
+  if (!leafVal["name"].isString() || !decode(leafVal["hash"], info.hash))
+    return false;
+  info.name = leafVal["name"].asString();
+  info.isBound = false;
+  return true;
+}
+
+
+
+// as above, but the directions are given so only the siblings are read
+bool MerkleTree::walkPath(const BinaryPath& path,
+                          PathInfo& info,
+                          HashMemo* memo)
+{
+  if (path.record)
+  {  // see readLeaf
+    info.hash = MultiSHA384::hash(path.record, path.recordLen);
+    info.isBound = true;
+  }
+  else
+  {
+    memcpy(info.hash.data(), path.hash, Const::SHA384_LEN);
+    info.isBound = false;
+  }
+
+  info.name.assign(reinterpret_cast<const char*>(path.name), path.nameLen);
+  info.index = 0;
+  info.depth = 0;
+  info.isRightmost = true;
+
+  SHA384_HASH hash = info.hash;
+  return walkNodes(path, hash, info, memo);
+}
+
+
+
+// continues a walk upwards from the hash through the nodes from first on,
+// each one level above the last, and leaves the final hash as the root
+bool MerkleTree::walkNodes(const Json::Value& nodes,
+                           Json::ArrayIndex first,
+                           SHA384_HASH& hash,
+                           PathInfo& info,
+                           HashMemo* memo)
+{
+  if (!nodes.isArray() || nodes.size() < first ||
+      info.depth + (nodes.size() - first) > 64)
+    return false;
+
+  for (Json::ArrayIndex j = first; j < nodes.size(); j++, info.depth++)
+  {
+    SHA384_HASH left, right;
+    bool hasRight = nodes[j].isMember("right");
+    if (!decode(nodes[j]["left"], left) ||
+        (hasRight && !decode(nodes[j]["right"], right)))
+      return false;
+    if (!hasRight)
+      right = left;  // odd node, its hash was paired with itself
+
+    if (hash == left)
+      info.isRightmost &= !hasRight;
+    else if (hasRight && hash == right)
+      info.index |= size_t(1) << info.depth;
+    else
+      return false;  // path is broken
+
+    hash = hashChildren(left, right, memo);
+  }
+
+  info.root = hash;
+  return true;
+}
+
+
+
+bool MerkleTree::walkNodes(const BinaryPath& path,
+                           SHA384_HASH& hash,
+                           PathInfo& info,
+                           HashMemo* memo)
+{
+  if (info.depth + path.depth > 64)
+    return false;
+
+  SHA384_HASH sibling;
+  const uint8_t* siblings = path.siblings;
+  for (size_t level = 0; level < path.depth; level++, info.depth++)
+  {
+    bool isRight = path.directions[level / 8] >> (level % 8) & 1;
+    if (path.selfPaired[level / 8] >> (level % 8) & 1)
+    {
+      if (isRight)
+        return false;  // only a left child can lack a sibling
+      hash = hashChildren(hash, hash, memo);
+      continue;
+    }
+
+    memcpy(sibling.data(), siblings, Const::SHA384_LEN);
+    siblings += Const::SHA384_LEN;
+    if (isRight)
+      info.index |= size_t(1) << info.depth;
+    else
+      info.isRightmost = false;
+
+    hash = isRight ? hashChildren(sibling, hash, memo)
+                   : hashChildren(hash, sibling, memo);
+  }
+
+  info.root = hash;
+  return true;
+}
+
+
+
+// reads and walks each path in a binary proof, returning false if it is
+// malformed rather than throwing as decodeProof does
+bool MerkleTree::walkProof(const std::string& proof,
+                           ProofInfo& info,
+                           HashMemo* memo)
+{
+  auto pos = reinterpret_cast<const uint8_t*>(proof.data());
+  auto end = pos + proof.size();
+  if (pos == end)
+    return false;
+
+  info.kind = *pos++;
+  info.hasLeft = info.hasRight = false;
+  BinaryPath path;
+  if (info.kind == PROOF_PATH)
+  {
+    info.hasLeft = true;
+    if (!readPath(pos, end, false, path) || !walkPath(path, info.left, memo))
+      return false;
+  }
+  else if (info.kind == PROOF_SPAN && pos < end)
+  {
+    uint8_t flags = *pos++;
+    if (flags & ~SPAN_FLAGS)
+      return false;
+
+    info.hasLeft = flags & SPAN_LEFT;
+    info.hasRight = flags & SPAN_RIGHT;
+    if (info.hasLeft &&
+        (!readPath(pos, end, true, path) || !walkPath(path, info.left, memo)))
+      return false;
+    if (info.hasRight &&
+        (!readPath(pos, end, true, path) || !walkPath(path, info.right, memo)))
+      return false;
+
+    if (flags & SPAN_COMMON)
+    {  // see verifySpan
+      PathInfo common;
+      SHA384_HASH hash;
+      if (!info.hasLeft || !info.hasRight || !readNodes(pos, end, path) ||
+          !joinBranches(info.left, info.right, hash, common, memo) ||
+          !walkNodes(path, hash, common, memo))
+        return false;
+      splitBranches(common, info.left, info.right);
+    }
+  }
+  else
+    return false;
+
+  return pos == end;
+}
+
+
+
+// points path into the next encoded path, or branch of a span if hasRecord,
+// returning false if it is truncated or not in its canonical form
+bool MerkleTree::readPath(const uint8_t*& pos,
+                          const uint8_t* end,
+                          bool hasRecord,
+                          BinaryPath& path)
+{
+  auto take = [&pos, end](size_t n, const uint8_t*& field)
+  {
+    if (static_cast<size_t>(end - pos) < n)
+      return false;
+    field = pos;
+    pos += n;
+    return true;
+  };
+
+  const uint8_t* len;
+  if (hasRecord)
+  {  // the name is read from the Record, see encodeBranch
+    path.hash = nullptr;
+    if (!take(2, len))
+      return false;
+    path.recordLen = static_cast<size_t>(len[0]) << 8 | len[1];
+    if (!take(path.recordLen, path.record) ||
+        !readRecordName(path.record, path.recordLen, path.name,
+                        path.nameLen) ||
+        path.nameLen > 255)
+      return false;
+  }
+  else
+  {
+    path.record = nullptr;
+    path.recordLen = 0;
+    if (!take(1, len) || !take(*len, path.name))
+      return false;
+    path.nameLen = *len;
+    if (!take(Const::SHA384_LEN, path.hash))
+      return false;
+  }
+
+  return readNodes(pos, end, path);
+}
+
+
+
+// points path at the next encoded nodes, which have no name or leaf; each
+// proof has one encoding, so bits past the depth and directions at levels
+// that were paired with themselves are refused
+bool MerkleTree::readNodes(const uint8_t*& pos,
+                           const uint8_t* end,
+                           BinaryPath& path)
+{
+  auto take = [&pos, end](size_t n, const uint8_t*& field)
+  {
+    if (static_cast<size_t>(end - pos) < n)
+      return false;
+    field = pos;
+    pos += n;
+    return true;
+  };
+
+  const uint8_t* len;
+  if (!take(1, len) || *len > 64)
+    return false;
+  path.depth = *len;
+
+  size_t bitmapLen = (path.depth + 7) / 8;
+  if (!take(bitmapLen, path.directions) || !take(bitmapLen, path.selfPaired))
+    return false;
+
+  uint8_t padding = static_cast<uint8_t>(0xff << (path.depth % 8));
+  if (path.depth % 8 != 0 && ((path.directions[bitmapLen - 1] & padding) ||
+                              (path.selfPaired[bitmapLen - 1] & padding)))
+    return false;
+
+  size_t nSiblings = 0;
+  for (size_t level = 0; level < path.depth; level++)
+  {
+    uint8_t bit = static_cast<uint8_t>(1 << (level % 8));
+    if (!(path.selfPaired[level / 8] & bit))
+      nSiblings++;
+    else if (path.directions[level / 8] & bit)
+      return false;
+  }
+  return take(nSiblings * Const::SHA384_LEN, path.siblings);
+}
+
+
+
+// hashes the children, or looks up the result if they have been seen before
+SHA384_HASH MerkleTree::hashChildren(const SHA384_HASH& left,
+                                     const SHA384_HASH& right,
+                                     HashMemo* memo)
+{
+  if (!memo)
+    return concatenateHashes(left, right);
+
+  std::string key(reinterpret_cast<const char*>(left.data()), left.size());
+  key.append(reinterpret_cast<const char*>(right.data()), right.size());
+  auto iter = memo->find(key);
+  if (iter == memo->end())
+    iter = memo->emplace(key, concatenateHashes(left, right)).first;
+  return iter->second;
+}
+
+
+
+// writes the leaf's path up to the given level as the length of its name,
+// the name, the leaf's hash, and then its nodes, see encodeNodes
+void MerkleTree::encodePath(size_t index,
+                            size_t depth,
+                            std::string& out) const
+{
+  std::string name = getName(index);
+  out.push_back(static_cast<char>(name.size()));
+  out += name;
+  out.append(reinterpret_cast<const char*>(rows_[0].hashes[index].data()),
+             Const::SHA384_LEN);
+  encodeNodes(index, 0, depth, out);
+}
+
+
+
+// as above for a branch of a span, whose leaf is given as the two-byte length
+// of its Record, big-endian, and the Record itself
+void MerkleTree::encodeBranch(size_t index,
+                              size_t depth,
+                              std::string& out) const
+{
+  std::string record = getRecord(index)->asJSON();
+  if (record.size() > 0xffff)
+    Log::get().error("Record of " + getName(index) +
+                     " is too large for a binary Merkle proof.");
+
+  out.push_back(static_cast<char>(record.size() >> 8));
+  out.push_back(static_cast<char>(record.size() & 0xff));
+  out += record;
+  encodeNodes(index, 0, depth, out);
+}
+
+
+
+// writes the path of the index between the levels as the number of levels, a
+// bitmap of which levels it was the right child at, a bitmap of the levels
+// where it had no sibling and was paired with itself, and then the hashes
+// of the siblings it did have, from the bottom up
+void MerkleTree::encodeNodes(size_t index,
+                             size_t from,
+                             size_t to,
+                             std::string& out) const
+{
+  size_t depth = to - from;
+  std::string directions((depth + 7) / 8, 0), selfPaired(directions);
+  std::string siblings;
+
+  for (size_t level = from; level < to; level++)
+  {
+    size_t j = index >> level, bit = level - from;
+    if (j & 1)
+      directions[bit / 8] |= static_cast<char>(1 << (bit % 8));
+
+    if ((j ^ 1) < rows_[level].size)
+    {
+      const auto& sibling = rows_[level].hashes[j ^ 1];
+      siblings.append(reinterpret_cast<const char*>(sibling.data()),
+                      sibling.size());
+    }
+    else
+      selfPaired[bit / 8] |= static_cast<char>(1 << (bit % 8));
+  }
+
+  out.push_back(static_cast<char>(depth));
+  out += directions + selfPaired + siblings;
+}
+
+
+
+// as above, a path or a branch if hasRecord, but recovers the directions by
+// walking the JSON path, and sets top to the hash of the last node
+void MerkleTree::encodePath(const Json::Value& path,
+                            bool hasRecord,
+                            SHA384_HASH& top,
+                            std::string& out)
+{
+  PathInfo leaf;
+  if (!path.isArray() || path.empty() || !readLeaf(path[0], leaf) ||
+      leaf.isBound != hasRecord || leaf.name.size() > 255)
+    Log::get().error("Invalid Merkle path.");
+
+  if (hasRecord)
+  {
+    std::string record = path[0]["record"].asString();
+    if (record.size() > 0xffff)
+      Log::get().error("Record of " + leaf.name +
+                       " is too large for a binary Merkle proof.");
+    out.push_back(static_cast<char>(record.size() >> 8));
+    out.push_back(static_cast<char>(record.size() & 0xff));
+    out += record;
+  }
+  else
+  {
+    out.push_back(static_cast<char>(leaf.name.size()));
+    out += leaf.name;
+    out.append(reinterpret_cast<const char*>(leaf.hash.data()),
+               leaf.hash.size());
+  }
+
+  top = leaf.hash;
+  encodeNodes(path, 1, top, out);
+}
+
+
+
+void MerkleTree::encodeNodes(const Json::Value& nodes,
+                             Json::ArrayIndex first,
+                             SHA384_HASH& hash,
+                             std::string& out)
+{
+  if (!nodes.isArray() || nodes.size() < first || nodes.size() - first > 64)
+    Log::get().error("Invalid Merkle path.");
+
+  size_t depth = nodes.size() - first;
+  std::string directions((depth + 7) / 8, 0), selfPaired(directions);
+  std::string siblings;
+
+  for (size_t level = 0; level < depth; level++)
+  {
+    const auto& node = nodes[static_cast<Json::ArrayIndex>(first + level)];
+    SHA384_HASH left, right;
+    bool hasRight = node.isMember("right");
+    if (!decode(node["left"], left) ||
+        (hasRight && !decode(node["right"], right)))
+      Log::get().error("Invalid Merkle path.");
+
+    const SHA384_HASH* sibling = &right;
+    if (!hasRight && hash == left)
+    {
+      right = left;
+      sibling = nullptr;
+      selfPaired[level / 8] |= static_cast<char>(1 << (level % 8));
+    }
+    else if (hasRight && hash == right)
+    {
+      sibling = &left;
+      directions[level / 8] |= static_cast<char>(1 << (level % 8));
+    }
+    else if (hash != left)
+      Log::get().error("Broken Merkle path.");
+
+    if (sibling)
+      siblings.append(reinterpret_cast<const char*>(sibling->data()),
+                      sibling->size());
+    hash = concatenateHashes(left, right);
+  }
+
+  out.push_back(static_cast<char>(depth));
+  out += directions + selfPaired + siblings;
+}
+
+
+
+// reads one path written by encodePath, rebuilding the JSON form by hashing
+// up from the leaf to recover each parent's other child, and sets top to the
+// hash of the last node
+Json::Value MerkleTree::decodePath(const uint8_t*& pos,
+                                   const uint8_t* end,
+                                   bool hasRecord,
+                                   SHA384_HASH& top)
+{
+  BinaryPath binary;
+  if (!readPath(pos, end, hasRecord, binary))
+    Log::get().error("Truncated or non-canonical Merkle proof.");
+
+  Json::Value leafVal;
+  if (hasRecord)
+  {
+    top = MultiSHA384::hash(binary.record, binary.recordLen);
+    leafVal["record"] = std::string(
+        reinterpret_cast<const char*>(binary.record), binary.recordLen);
+  }
+  else
+  {
+    memcpy(top.data(), binary.hash, Const::SHA384_LEN);
+    leafVal["name"] =
+        std::string(reinterpret_cast<const char*>(binary.name), binary.nameLen);
+    leafVal["hash"] = encode(top);
+  }
+
+  Json::Value path;
+  path.append(leafVal);
+
+  decodeNodes(binary, top, path);
+  return path;
+}
+
+
+
+void MerkleTree::decodeNodes(const BinaryPath& binary,
+                             SHA384_HASH& hash,
+                             Json::Value& out)
+{
+  SHA384_HASH sibling;
+  const uint8_t* siblings = binary.siblings;
+  for (size_t level = 0; level < binary.depth; level++)
+  {
+    Json::Value node;
+    if (binary.selfPaired[level / 8] >> (level % 8) & 1)
+    {
+      node["left"] = encode(hash);
+      hash = concatenateHashes(hash, hash);
+    }
+    else
+    {
+      memcpy(sibling.data(), siblings, Const::SHA384_LEN);
+      siblings += Const::SHA384_LEN;
+
+      bool isRight = binary.directions[level / 8] >> (level % 8) & 1;
+      const SHA384_HASH& left = isRight ? sibling : hash;
+      const SHA384_HASH& right = isRight ? hash : sibling;
+      node["left"] = encode(left);
+      node["right"] = encode(right);
+      hash = concatenateHashes(left, right);
+    }
+
+    out.append(node);
+  }
+}
+
+
+
+// finds the value of the top-level "name" in a Record's JSON without parsing
+// it, as span proofs are checked without allocating; only the serialization
+// that the leaf hashes is ever read, so a name that needed escaping is refused
+// rather than unescaped
+bool MerkleTree::readRecordName(const uint8_t* json,
+                                size_t len,
+                                const uint8_t*& name,
+                                size_t& nameLen)
+{
+  size_t depth = 0;
+  uint8_t previous = 0;  // the last byte outside of a string
+  bool isName = false;   // whether the last key at the top level was "name"
+  for (size_t j = 0; j < len; j++)
+  {
+    if (json[j] != '"')
+    {
+      if (json[j] == '{' || json[j] == '[')
+        depth++;
+      else if ((json[j] == '}' || json[j] == ']') && depth-- == 0)
+        return false;
+      previous = json[j];
+      continue;
+    }
+
+    // find the end of the string, noting whether it has escapes
+    size_t begin = j + 1;
+    bool isEscaped = false;
+    for (j = begin; j < len && json[j] != '"'; j++)
+      if (json[j] == '\\')
+      {
+        isEscaped = true;
+        j++;
+      }
+    if (j >= len)
+      return false;
+
+    if (depth == 1 && (previous == '{' || previous == ','))
+      isName = j - begin == 4 && memcmp(json + begin, "name", 4) == 0;
+    else if (depth == 1 && previous == ':' && isName)
+    {
+      name = json + begin;
+      nameLen = j - begin;
+      return !isEscaped;
+    }
+    previous = '"';
+  }
+
+  return false;
+}
+
+
+
+bool MerkleTree::decode(const Json::Value& value, SHA384_HASH& hash)
+{
+  if (!value.isString() || value.asString().size() != 64)
+    return false;  // base64 of 48 bytes
+
+  return Botan::base64_decode(hash.data(), value.asString()) ==
+         Const::SHA384_LEN;
+}
+
+
+
+// returns the root that the path leads to: the leaf's hash for a tree with
+// a single leaf, otherwise the hash of the topmost node's children
+SHA384_HASH MerkleTree::extractPathRoot(const Json::Value& path)
+{
+  SHA384_HASH root;
+  root.fill(0);
+
+  if (!path.isArray() || path.empty())
+  {
+    Log::get().warn("Invalid Merkle path.");
+    return root;
+  }
+
+  const Json::Value& top = path[path.size() - 1];
+  if (path.size() == 1)
+  {  // the leaf is the root
+    PathInfo leaf;
+    if (!readLeaf(top, leaf))
+      Log::get().warn("Invalid root size for Merkle subtree.");
+    else
+      root = leaf.hash;
+    return root;
+  }
+
+  if (!hashNode(top, root))
+  {
+    Log::get().warn("Invalid root size for Merkle subtree.");
+    root.fill(0);
+  }
+
+  return root;
+}
+
+
+
+// hashes the node's children, its left child twice if it has no right one
+bool MerkleTree::hashNode(const Json::Value& node, SHA384_HASH& hash)
+{
+  SHA384_HASH left, right;
+  bool hasRight = node.isMember("right");
+  if (!decode(node["left"], left) ||
+      (hasRight && !decode(node["right"], right)))
+    return false;
+
+  hash = concatenateHashes(left, hasRight ? right : left);
+  return true;
+}
+
+
+
+std::string MerkleTree::encode(const SHA384_HASH& hash)
+{
+  return Botan::base64_encode(hash.data(), Const::SHA384_LEN);
+}
+
+
+
+// splits [0, n) into contiguous chunks across the available cores, or runs
+// it inline if there is too little work to be worth the threads
+void MerkleTree::parallelFor(size_t n,
+                             const std::function<void(size_t, size_t)>& work)
+{
+  size_t nThreads = std::min<size_t>(std::thread::hardware_concurrency(),
+                                     n / PARALLEL_THRESHOLD);
+  if (nThreads <= 1)
+  {
+    work(0, n);
+    return;
+  }
+
+  std::vector<std::exception_ptr> errors(nThreads);
+  std::vector<std::thread> workers;
+  for (size_t t = 0; t < nThreads; t++)
+  {
+    workers.push_back(std::thread([&work, &errors, n, nThreads, t]()
+                                  {
+                                    try
+                                    {
+                                      work(n * t / nThreads,
+                                           n * (t + 1) / nThreads);
+                                    }
+                                    catch (...)
+                                    {
+                                      errors[t] = std::current_exception();
+                                    }
+                                  }));
+  }
+
+  std::for_each(workers.begin(), workers.end(), [](std::thread& t)
+                {
+                  t.join();
+                });
+
+  for (auto error : errors)
+    if (error)
+      std::rethrow_exception(error);
 }
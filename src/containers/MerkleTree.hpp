@@ -2,72 +2,220 @@
 #ifndef MERKLE_TREE_HPP
 #define MERKLE_TREE_HPP
 
+#include "ProofCache.hpp"
 #include "records/Record.hpp"
 #include "../Constants.hpp"
 #include <json/json.h>
+#include <functional>
+#include <unordered_map>
 #include <vector>
 #include <memory>
 #include <string>
 
+// Each leaf is its Record's hash. A path proves a Record that the verifier
+// already holds, so the leaf is checked against it. A span instead carries
+// the Records on either side of the missing name, and the verifier hashes
+// them to their leaves and reads their names from them, so the bounds that
+// it orders the name between are bound to the tree.
 class MerkleTree
-{  // this tree is built and referenced from the leaves to the root
+{  // this tree is built from the leaves to the root
 
  public:
   MerkleTree(const std::vector<RecordPtr>&);
+  MerkleTree(const std::string&, size_t);  // maps a file written by save()
+  void save(const std::string&) const;
+  void insert(const RecordPtr&);
+  void insert(const std::vector<RecordPtr>&);
   Json::Value generateSubtree(const std::string&) const;
+  std::string generateProof(const std::string&) const;
   static bool doesContain(const Json::Value&, const RecordPtr&);
+  static bool doesExclude(const Json::Value&, const std::string&);
   static SHA384_HASH extractRoot(const Json::Value&);
+  static std::vector<RecordPtr> sortBatch(const std::vector<RecordPtr>&);
   SHA384_HASH getRootHash() const;
-
- private:
-  class Node
-  {
+  size_t getSize() const;
+  void setProofCacheSize(size_t);  // in bytes, for generateProof
+  Json::Value getProofCacheStats() const;
+
+  // spans carry the Records beside the missing name, which a mapped tree
+  // does not hold, so it looks them up by name through this
+  typedef std::function<RecordPtr(const std::string&)> RecordSource;
+  void setRecordSource(const RecordSource&);
+
+  // compact binary form of a subtree, see encodePath()
+  static std::string encodeProof(const Json::Value&);
+  static Json::Value decodeProof(const std::string&);
+  static bool doesContain(const std::string&, const RecordPtr&);
+  static bool doesExclude(const std::string&, const std::string&);
+  static SHA384_HASH extractRoot(const std::string&);
+
+  // proves many present and absent names at once, see generateMultiproof()
+  Json::Value generateMultiproof(const std::vector<std::string>&) const;
+  static bool doesProve(const Json::Value&,
+                        const std::vector<RecordPtr>&,
+                        const std::vector<std::string>&,
+                        SHA384_HASH&);
+
+  class Verifier
+  {  // checks many proofs against one root, hashing shared ancestors once
    public:
-    typedef std::shared_ptr<MerkleTree::Node> NodePtr;
-
-    Node();
-    Node(const NodePtr&, const SHA384_HASH&);
-    virtual ~Node() {}
-    void setParent(const NodePtr&);
-    void setChildren(const NodePtr&, const NodePtr&);
-    NodePtr getParent() const;
-    SHA384_HASH getHash() const;  // http://sphincs.cr.yp.to/
-    std::string getBase64Hash() const;
-    Json::Value asValue() const;
-
-   protected:
-    NodePtr parent_, leftChild_, rightChild_;
-    SHA384_HASH hash_;
-  };
+    Verifier(const SHA384_HASH&);
+    bool doesContain(const Json::Value&, const RecordPtr&);
+    bool doesExclude(const Json::Value&, const std::string&);
+    bool doesContain(const std::string&, const RecordPtr&);
+    bool doesExclude(const std::string&, const std::string&);
+    bool doesProve(const Json::Value&,
+                   const std::vector<RecordPtr>&,
+                   const std::vector<std::string>&);
+    size_t getHashCount() const;
 
-  typedef std::shared_ptr<MerkleTree::Node> NodePtr;
+   private:
+    SHA384_HASH root_;
+    std::unordered_map<std::string, SHA384_HASH> memo_;  // children -> hash
+  };
 
-  class Leaf : public Node
-  {
-   public:
-    Leaf(const RecordPtr&, const NodePtr&);
-    Leaf(const std::string&);
-    std::string getName() const;
+ private:
+  friend class MerkleBuilder;  // streams files in the format of save()
+  friend class MerkleProof;    // decodes the binary form into fixed arrays
+  typedef std::unordered_map<std::string, SHA384_HASH> HashMemo;
+
+  struct PathInfo
+  {  // hash is the leaf, the hash of its Record
+    std::string name;
+    SHA384_HASH hash, root;
+    size_t index, depth;  // of the leaf, from the path's direction bits
+    bool isRightmost;
+    bool isBound;  // the name was read from the Record, not given beside it
+  };
 
-   private:
-    std::string name_;
+  struct ProofInfo
+  {  // a path fills only left
+    uint8_t kind;
+    bool hasLeft, hasRight;
+    PathInfo left, right;
   };
 
-  typedef std::shared_ptr<MerkleTree::Leaf> LeafPtr;
+  struct Row
+  {  // one level's hashes, held in levels_ or in the mapped file
+    const SHA384_HASH* hashes;
+    size_t size;
+  };
 
-  SHA384_HASH buildTree(std::vector<NodePtr>&);
-  static SHA384_HASH concatenateHashes(const NodePtr&, const NodePtr&);
-  Json::Value generatePath(const LeafPtr&) const;
-  Json::Value generateSpan(const LeafPtr&,
-                           const std::vector<LeafPtr>::const_iterator&) const;
+  struct FileHeader
+  {  // followed by each level's hashes, leafCount + 1 offsets, and the names
+    uint64_t magic;
+    uint32_t version, levelCount;
+    uint64_t leafCount, namesSize;
+    uint8_t root[Const::SHA384_LEN];
+  };
 
-  static bool verifyPath(const Json::Value& value, const RecordPtr&);
-  static bool verifySpan(const Json::Value& value, const RecordPtr&);
+  struct BinaryPath
+  {  // points into an encoded proof, see encodePath(); a branch of a span
+     // has its Record in place of the name and hash
+    const uint8_t *name, *hash, *record, *directions, *selfPaired, *siblings;
+    size_t nameLen, recordLen, depth;
+  };
 
-  static bool isLessThan(const LeafPtr&, const LeafPtr&);
+  void buildLevels();
+  void refreshRows();
+  void materialize();
+  size_t findName(const std::string&, bool&) const;
+  std::string getName(size_t) const;
+  RecordPtr getRecord(size_t) const;
+  static bool writeAll(int, const void*, size_t);
+  void rehash(std::vector<size_t>, size_t);
+  static SHA384_HASH concatenateHashes(const SHA384_HASH&, const SHA384_HASH&);
+  Json::Value generatePath(size_t, size_t) const;
+  Json::Value generateBranch(size_t, size_t) const;
+  Json::Value generateSpan(size_t) const;
+  void appendNodes(size_t, size_t, size_t, Json::Value&) const;
+  static size_t getJoinLevel(size_t);
+
+  static bool verifyPath(const Json::Value&,
+                         const RecordPtr&,
+                         PathInfo&,
+                         HashMemo*);
+  static bool verifySpan(const Json::Value&,
+                         const std::string&,
+                         PathInfo&,
+                         HashMemo*);
+  static bool checkSpan(const PathInfo*, const PathInfo*, const std::string&);
+  static bool joinBranches(const PathInfo&,
+                           const PathInfo&,
+                           SHA384_HASH&,
+                           PathInfo&,
+                           HashMemo*);
+  static void splitBranches(const PathInfo&, PathInfo&, PathInfo&);
+  static bool walkMultiproof(const Json::Value&,
+                             std::vector<PathInfo>&,
+                             size_t&,
+                             SHA384_HASH&,
+                             HashMemo*);
+  static bool checkMultiproof(const std::vector<PathInfo>&,
+                              size_t,
+                              const std::vector<RecordPtr>&,
+                              const std::vector<std::string>&);
+  static bool walkPath(const Json::Value&, PathInfo&, HashMemo*);
+  static bool readLeaf(const Json::Value&, PathInfo&);
+  static bool walkPath(const BinaryPath&, PathInfo&, HashMemo*);
+  static bool walkNodes(const Json::Value&,
+                        Json::ArrayIndex,
+                        SHA384_HASH&,
+                        PathInfo&,
+                        HashMemo*);
+  static bool walkNodes(const BinaryPath&, SHA384_HASH&, PathInfo&, HashMemo*);
+  static bool walkProof(const std::string&, ProofInfo&, HashMemo*);
+  static bool readPath(const uint8_t*&, const uint8_t*, bool, BinaryPath&);
+  static bool readNodes(const uint8_t*&, const uint8_t*, BinaryPath&);
+  static SHA384_HASH hashChildren(const SHA384_HASH&,
+                                  const SHA384_HASH&,
+                                  HashMemo*);
+  static bool readRecordName(const uint8_t*, size_t, const uint8_t*&, size_t&);
+  static bool decode(const Json::Value&, SHA384_HASH&);
+  static SHA384_HASH extractPathRoot(const Json::Value&);
+  static bool hashNode(const Json::Value&, SHA384_HASH&);
+  void encodePath(size_t, size_t, std::string&) const;
+  void encodeBranch(size_t, size_t, std::string&) const;
+  void encodeNodes(size_t, size_t, size_t, std::string&) const;
+  static void encodePath(const Json::Value&, bool, SHA384_HASH&, std::string&);
+  static void encodeNodes(const Json::Value&,
+                          Json::ArrayIndex,
+                          SHA384_HASH&,
+                          std::string&);
+  static Json::Value decodePath(const uint8_t*&,
+                                const uint8_t*,
+                                bool,
+                                SHA384_HASH&);
+  static void decodeNodes(const BinaryPath&, SHA384_HASH&, Json::Value&);
+
+  static const uint8_t PROOF_PATH = 1, PROOF_SPAN = 2;
+  static const uint8_t SPAN_LEFT = 1, SPAN_RIGHT = 2, SPAN_COMMON = 4;
+  static const uint8_t SPAN_FLAGS = SPAN_LEFT | SPAN_RIGHT | SPAN_COMMON;
+  static std::string encode(const SHA384_HASH&);
+  static void parallelFor(size_t, const std::function<void(size_t, size_t)>&);
+
+  static const size_t PARALLEL_THRESHOLD = 4096;  // minimum nodes per thread
+  static const size_t DEFAULT_PROOF_CACHE = 16 * 1024 * 1024;
+  static const uint64_t FILE_MAGIC = 0x544d534e6f696e4f;  // "OnioNSMT"
+  static const uint32_t FILE_VERSION = 1;
+
+  // levels_[0] holds the leaf hashes and each level above holds the hashes
+  // of pairs from the one below, so node j's parent is j / 2 and its sibling
+  // is j ^ 1; an odd last node is paired with itself
+  std::vector<std::vector<SHA384_HASH> > levels_;
+  std::vector<std::string> names_;  // of each leaf, sorted
+  std::vector<RecordPtr> records_;  // of each leaf, null if it was mapped
+  RecordSource recordSource_;       // for those that records_ lacks
+
+  // readers go through rows_ and getName(), which point into the file when
+  // the tree is mapped; the first insert copies it into levels_ and names_
+  std::vector<Row> rows_;
+  std::shared_ptr<const uint8_t> mapping_;  // unmapped when released
+  const uint64_t* nameOffsets_;             // into nameBlob_, if mapped
+  const char* nameBlob_;
 
-  std::vector<LeafPtr> leaves_;
   SHA384_HASH rootHash_;
+  mutable ProofCache proofCache_;  // of popular names under rootHash_
 };
 
 typedef std::shared_ptr<MerkleTree> MerkleTreePtr;
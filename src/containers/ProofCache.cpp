@@ -0,0 +1,151 @@
+
+#include "ProofCache.hpp"
+
+
+ProofCache::ProofCache(size_t capacity)
+    : capacity_(capacity),
+      bytes_(0),
+      hits_(0),
+      misses_(0),
+      evictions_(0),
+      invalidations_(0)
+{
+  root_.fill(0);
+}
+
+
+
+// sets proof to the cached proof of the name under the given root
+bool ProofCache::lookup(const SHA384_HASH& root,
+                        const std::string& name,
+                        std::string& proof)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (root != root_)
+    reset(root);
+
+  auto iter = map_.find(name);
+  if (iter == map_.end())
+  {
+    misses_++;
+    return false;
+  }
+
+  hits_++;
+  entries_.splice(entries_.begin(), entries_, iter->second);  // mark recent
+  proof = iter->second->proof_;
+  return true;
+}
+
+
+
+void ProofCache::store(const SHA384_HASH& root,
+                       const std::string& name,
+                       const std::string& proof)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (root != root_)
+    reset(root);
+
+  size_t cost = getCost(name, proof);
+  if (cost > capacity_)
+    return;  // would evict everything else, and then itself
+
+  auto iter = map_.find(name);
+  if (iter != map_.end())
+  {
+    bytes_ -= getCost(name, iter->second->proof_);
+    entries_.erase(iter->second);
+    map_.erase(iter);
+  }
+
+  evict(capacity_ - cost);
+
+  Entry entry;
+  entry.name_ = name;
+  entry.proof_ = proof;
+  entries_.push_front(std::move(entry));
+  map_[name] = entries_.begin();
+  bytes_ += cost;
+}
+
+
+
+void ProofCache::setCapacity(size_t bytes)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  capacity_ = bytes;
+  evict(capacity_);
+}
+
+
+
+void ProofCache::clear()
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  entries_.clear();
+  map_.clear();
+  bytes_ = 0;
+}
+
+
+
+Json::Value ProofCache::getStats() const
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  Json::Value stats;
+
+  stats["entries"] = Json::UInt64(entries_.size());
+  stats["bytes"] = Json::UInt64(bytes_);
+  stats["capacity"] = Json::UInt64(capacity_);
+  stats["hits"] = Json::UInt64(hits_);
+  stats["misses"] = Json::UInt64(misses_);
+  stats["hitRate"] =
+      hits_ + misses_ == 0 ? 0.0 : static_cast<double>(hits_) /
+                                       static_cast<double>(hits_ + misses_);
+  stats["evictions"] = Json::UInt64(evictions_);
+  stats["invalidations"] = Json::UInt64(invalidations_);
+
+  return stats;
+}
+
+
+
+// ************************** PRIVATE METHODS **************************** //
+
+
+
+// drops every proof of the old root; the caller holds the lock
+void ProofCache::reset(const SHA384_HASH& root)
+{
+  if (!entries_.empty())
+    invalidations_++;
+
+  entries_.clear();
+  map_.clear();
+  bytes_ = 0;
+  root_ = root;
+}
+
+
+
+// removes the least recently used entries until at most the given number of
+// bytes remain; the caller holds the lock
+void ProofCache::evict(size_t bytes)
+{
+  while (bytes_ > bytes && !entries_.empty())
+  {
+    const auto& entry = entries_.back();
+    bytes_ -= getCost(entry.name_, entry.proof_);
+    map_.erase(entry.name_);
+    entries_.pop_back();
+    evictions_++;
+  }
+}
+
+
+
+size_t ProofCache::getCost(const std::string& name, const std::string& proof)
+{
+  return 2 * name.size() + proof.size() + ENTRY_OVERHEAD;
+}
@@ -0,0 +1,48 @@
+
+#ifndef PROOF_CACHE_HPP
+#define PROOF_CACHE_HPP
+
+#include "../Constants.hpp"
+#include <json/json.h>
+#include <unordered_map>
+#include <mutex>
+#include <list>
+#include <string>
+#include <cstdint>
+
+// Server-side map from name to its serialized Merkle proof, bounded in bytes
+// by LRU. Proofs are only valid for the root they were generated under, so
+// every entry is dropped as soon as a different root is seen.
+class ProofCache
+{
+ public:
+  ProofCache(size_t);
+  bool lookup(const SHA384_HASH&, const std::string&, std::string&);
+  void store(const SHA384_HASH&, const std::string&, const std::string&);
+  void setCapacity(size_t);  // in bytes
+  void clear();
+  Json::Value getStats() const;
+
+ private:
+  struct Entry
+  {
+    std::string name_, proof_;
+  };
+
+  void reset(const SHA384_HASH&);
+  void evict(size_t);
+  static size_t getCost(const std::string&, const std::string&);
+
+  // bookkeeping per entry beyond its strings: list node, map slot, and key
+  static const size_t ENTRY_OVERHEAD = 2 * sizeof(Entry) + 64;
+
+  size_t capacity_, bytes_;
+  SHA384_HASH root_;
+  uint64_t hits_, misses_, evictions_, invalidations_;
+
+  mutable std::mutex mutex_;
+  std::list<Entry> entries_;  // most recently used first
+  std::unordered_map<std::string, std::list<Entry>::iterator> map_;
+};
+
+#endif
@@ -0,0 +1,187 @@
+
+#include "Reconciler.hpp"
+#include "../Log.hpp"
+
+
+Reconciler::Reconciler()
+{
+  for (size_t nCells = MIN_CELLS; nCells <= MAX_PREBUILT_CELLS; nCells *= 4)
+    tables_.push_back(InvertibleBloomTable(nCells));
+}
+
+
+
+void Reconciler::add(const RecordPtr& record)
+{
+  uint64_t key = getKey(record);
+  if (!records_.emplace(key, record).second)
+    return;
+
+  for (auto& table : tables_)
+    table.insert(key);
+  estimator_.insert(key);
+}
+
+
+
+void Reconciler::remove(const RecordPtr& record)
+{
+  uint64_t key = getKey(record);
+  if (records_.erase(key) == 0)
+    return;
+
+  for (auto& table : tables_)
+    table.erase(key);
+  estimator_.erase(key);
+}
+
+
+
+// the same size whatever the size of the set, sent ahead of any sketch
+Json::Value Reconciler::getEstimator() const
+{
+  return estimator_.asJSON();
+}
+
+
+
+// approximate number of Records held by only one of us and the estimator's
+// sender, to size the sketch sent back with getCellCount()
+size_t Reconciler::estimateDifference(const Json::Value& remoteEstimator) const
+{
+  return estimator_.estimate(StrataEstimator::fromJSON(remoteEstimator));
+}
+
+
+
+Json::Value Reconciler::getSketch() const
+{
+  return getSketch(DEFAULT_CELLS);
+}
+
+
+
+// a table of at least the given size, e.g. four times the last when
+// retrying a failed diff
+Json::Value Reconciler::getSketch(size_t nCells) const
+{
+  return buildTable(getTableSize(nCells)).asJSON();
+}
+
+
+
+// compares against the other side's sketch, returning false if the
+// difference could not be fully decoded
+bool Reconciler::diff(const Json::Value& remoteSketch,
+                      std::vector<RecordPtr>& onlyHere,
+                      std::vector<uint64_t>& onlyThere) const
+{
+  // sizes off the steps of getTableSize() would need a table built from the
+  // whole set, so they are refused rather than built on request
+  auto remote = InvertibleBloomTable::fromJSON(remoteSketch);
+  if (getTableSize(remote.getCellCount()) != remote.getCellCount())
+    Log::get().error("Sketch of " + std::to_string(remote.getCellCount()) +
+                     " cells is not of a reconcilable size.");
+
+  auto local = buildTable(remote.getCellCount());
+  local.subtract(remote);
+
+  std::vector<uint64_t> localKeys;
+  if (!local.decode(localKeys, onlyThere))
+  {
+    Log::get().notice("Set difference exceeds sketch of " +
+                      std::to_string(remote.getCellCount()) + " cells.");
+    onlyThere.clear();
+    return false;
+  }
+
+  for (auto key : localKeys)
+  {
+    auto iter = records_.find(key);
+    if (iter == records_.end())
+    {  // decoded garbage, treat as a failure
+      onlyHere.clear();
+      onlyThere.clear();
+      return false;
+    }
+    onlyHere.push_back(iter->second);
+  }
+
+  return true;
+}
+
+
+
+std::vector<RecordPtr> Reconciler::resolve(
+    const std::vector<uint64_t>& keys) const
+{
+  std::vector<RecordPtr> records;
+  for (auto key : keys)
+  {
+    auto iter = records_.find(key);
+    if (iter != records_.end())
+      records.push_back(iter->second);
+  }
+
+  return records;
+}
+
+
+
+size_t Reconciler::getSize() const
+{
+  return records_.size();
+}
+
+
+
+// cells for a sketch that can list the estimated difference: about two per
+// Record, which also absorbs most of the estimate's error
+size_t Reconciler::getCellCount(size_t difference)
+{
+  return getTableSize(2 * difference);
+}
+
+
+
+// the Record hash covers its name and contents, so changed Records differ too
+uint64_t Reconciler::getKey(const RecordPtr& record)
+{
+  auto hash = record->getHash();
+  uint64_t key = 0;
+  for (size_t j = 0; j < sizeof(key); j++)
+    key = key << 8 | hash[j];
+  return key;
+}
+
+
+
+// ************************** PRIVATE METHODS **************************** //
+
+
+
+// rounds up to the next size in steps of four from MIN_CELLS, the first few
+// of which are prebuilt, capped at the largest the other side accepts
+size_t Reconciler::getTableSize(size_t nCells)
+{
+  size_t size = MIN_CELLS;
+  while (size < nCells && size * 4 <= InvertibleBloomTable::MAX_CELLS)
+    size *= 4;
+  return size;
+}
+
+
+
+// copies the prebuilt table of that size, or builds one from the whole set
+// for a size beyond them or one that getCellCount() would not pick
+InvertibleBloomTable Reconciler::buildTable(size_t nCells) const
+{
+  for (const auto& table : tables_)
+    if (table.getCellCount() == nCells)
+      return table;
+
+  InvertibleBloomTable table(nCells);
+  for (const auto& entry : records_)
+    table.insert(entry.first);
+  return table;
+}
@@ -0,0 +1,53 @@
+
+#ifndef RECONCILER_HPP
+#define RECONCILER_HPP
+
+#include "InvertibleBloomTable.hpp"
+#include "StrataEstimator.hpp"
+#include "records/Record.hpp"
+#include <unordered_map>
+#include <vector>
+
+// Tracks a set of Records so that two sides can find the Records they do not
+// share while exchanging data proportional to the difference, not the set.
+// One side sends getEstimator(), and the other replies with a sketch sized
+// from estimateDifference() by getCellCount(). The first side calls diff() on
+// that sketch, returning the Records only it holds and the keys of those only
+// the sender holds; the sender turns those keys back into Records with
+// resolve(). If diff() fails, the estimate fell short, so retry with the next
+// larger sketch. Tables are kept up to date at each size that getCellCount()
+// picks up to MAX_PREBUILT_CELLS, so neither a sketch nor its diff rebuilds
+// one from the whole set.
+class Reconciler
+{
+ public:
+  Reconciler();
+  void add(const RecordPtr&);
+  void remove(const RecordPtr&);
+  Json::Value getEstimator() const;
+  size_t estimateDifference(const Json::Value&) const;
+  Json::Value getSketch() const;
+  Json::Value getSketch(size_t) const;
+  bool diff(const Json::Value&,
+            std::vector<RecordPtr>&,
+            std::vector<uint64_t>&) const;
+  std::vector<RecordPtr> resolve(const std::vector<uint64_t>&) const;
+  size_t getSize() const;
+
+  static size_t getCellCount(size_t);
+  static uint64_t getKey(const RecordPtr&);
+
+  static const size_t MIN_CELLS = 96;  // each size is four times the last
+  static const size_t DEFAULT_CELLS = 1536;
+  static const size_t MAX_PREBUILT_CELLS = 24576;
+
+ private:
+  static size_t getTableSize(size_t);
+  InvertibleBloomTable buildTable(size_t) const;
+
+  std::vector<InvertibleBloomTable> tables_;  // MIN_CELLS to MAX_PREBUILT_CELLS
+  StrataEstimator estimator_;
+  std::unordered_map<uint64_t, RecordPtr> records_;
+};
+
+#endif
@@ -0,0 +1,138 @@
+
+#include "ResolverCache.hpp"
+#include "MerkleTree.hpp"
+#include "../Common.hpp"
+
+
+ResolverCache::ResolverCache(size_t capacity,
+                             std::chrono::seconds ttl,
+                             std::chrono::seconds negativeTtl)
+    : capacity_(capacity), ttl_(ttl), negativeTtl_(negativeTtl)
+{
+}
+
+
+
+// caches where the name resolves to if the path proves its Record against
+// the root; the destination is read from that Record, not taken on trust
+bool ResolverCache::put(const std::string& name,
+                        const RecordPtr& record,
+                        const Json::Value& path,
+                        const SHA384_HASH& root)
+{
+  if (!MerkleTree::doesContain(path, record) ||
+      MerkleTree::extractRoot(path) != root)
+    return false;
+
+  std::string destination;
+  try
+  {
+    destination = Common::getDestination(record, name);
+  }
+  catch (const std::runtime_error&)
+  {
+    return false;  // the Record does not resolve this name
+  }
+
+  store(name, destination, false);
+  return true;
+}
+
+
+
+// caches the absence of the name if the span proves it against the root; its
+// branches carry their Records, whose names are read from what the leaves
+// hash, so they cannot be relabelled to bound a name that exists
+bool ResolverCache::putNegative(const std::string& name,
+                                const Json::Value& span,
+                                const SHA384_HASH& root)
+{
+  if (!MerkleTree::doesExclude(span, name) ||
+      MerkleTree::extractRoot(span) != root)
+    return false;
+
+  store(name, "", true);
+  return true;
+}
+
+
+
+ResolverCache::Status ResolverCache::lookup(const std::string& name,
+                                            std::string& destination)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+
+  auto iter = map_.find(name);
+  if (iter == map_.end())
+    return Miss;
+
+  auto entry = iter->second;
+  if (entry->expiry_ <= Clock::now())
+  {
+    entries_.erase(entry);
+    map_.erase(iter);
+    return Miss;
+  }
+
+  entries_.splice(entries_.begin(), entries_, entry);  // mark as recent
+  if (entry->negative_)
+    return NonExistent;
+
+  destination = entry->destination_;
+  return Resolved;
+}
+
+
+
+void ResolverCache::clear()
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  entries_.clear();
+  map_.clear();
+}
+
+
+
+size_t ResolverCache::getSize() const
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  return entries_.size();
+}
+
+
+
+// ************************** PRIVATE METHODS **************************** //
+
+
+
+void ResolverCache::store(const std::string& name,
+                          const std::string& destination,
+                          bool negative)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (capacity_ == 0)
+    return;
+
+  auto iter = map_.find(name);
+  if (iter != map_.end())
+  {
+    entries_.erase(iter->second);
+    map_.erase(iter);
+  }
+
+  // evict the least recently used entry
+  if (entries_.size() >= capacity_)
+  {
+    map_.erase(entries_.back().name_);
+    entries_.pop_back();
+  }
+
+  Entry entry;
+  entry.name_ = name;
+  entry.destination_ = destination;
+  entry.expiry_ = Clock::now() + (negative ? negativeTtl_ : ttl_);
+  entry.negative_ = negative;
+
+  entries_.push_front(entry);
+  map_[name] = entries_.begin();
+}
@@ -0,0 +1,58 @@
+
+#ifndef RESOLVER_CACHE_HPP
+#define RESOLVER_CACHE_HPP
+
+#include "records/Record.hpp"
+#include "../Constants.hpp"
+#include <json/json.h>
+#include <unordered_map>
+#include <chrono>
+#include <mutex>
+#include <list>
+#include <string>
+
+// Client-side map from FQDN to destination, bounded by LRU and expired by TTL.
+// Entries are only stored with a proof against a trusted root: a path to the
+// Record that resolves the name, or a span for names proven not to exist,
+// which are remembered as negative entries.
+class ResolverCache
+{
+ public:
+  enum Status
+  {
+    Miss,
+    Resolved,
+    NonExistent
+  };
+
+  ResolverCache(size_t, std::chrono::seconds, std::chrono::seconds);
+  bool put(const std::string&,
+           const RecordPtr&,
+           const Json::Value&,
+           const SHA384_HASH&);
+  bool putNegative(const std::string&, const Json::Value&, const SHA384_HASH&);
+  Status lookup(const std::string&, std::string&);
+  void clear();
+  size_t getSize() const;
+
+ private:
+  typedef std::chrono::steady_clock Clock;
+
+  struct Entry
+  {
+    std::string name_, destination_;
+    Clock::time_point expiry_;
+    bool negative_;
+  };
+
+  void store(const std::string&, const std::string&, bool);
+
+  const size_t capacity_;
+  const std::chrono::seconds ttl_, negativeTtl_;
+
+  mutable std::mutex mutex_;
+  std::list<Entry> entries_;  // most recently used first
+  std::unordered_map<std::string, std::list<Entry>::iterator> map_;
+};
+
+#endif
@@ -0,0 +1,392 @@
+
+#include "SparseMerkleTree.hpp"
+#include "../Log.hpp"
+#include "../crypto/MultiSHA384.hpp"
+#include <botan/sha2_64.h>
+#include <botan/base64.h>
+#include <algorithm>
+#include <cstring>
+
+
+SparseMerkleTree::SparseMerkleTree(const std::vector<RecordPtr>& records)
+    : size_(0)
+{
+  Log::get().notice("Building sparse Merkle tree of size " +
+                    std::to_string(records.size()));
+
+  std::vector<Leaf> leaves;
+  leaves.reserve(records.size());
+  for (auto r : records)
+    leaves.push_back(Leaf(getKey(r->getName()), r->getHash()));
+
+  // by key, keeping only the last Record of any name
+  std::stable_sort(leaves.begin(), leaves.end(),
+                   [](const Leaf& a, const Leaf& b)
+                   {
+                     return a.first < b.first;
+                   });
+  std::vector<Leaf> unique;
+  for (size_t j = 0; j < leaves.size(); j++)
+    if (j + 1 == leaves.size() || leaves[j].first != leaves[j + 1].first)
+      unique.push_back(leaves[j]);
+
+  size_ = unique.size();
+  if (!unique.empty())
+    root_ = build(unique, 0, unique.size(), 0);
+
+  Log::get().notice("Built sparse tree. Root is " +
+                    encode(getRootHash().data(), Const::SHA384_LEN));
+}
+
+
+
+// adds the Record's leaf, or replaces the leaf of the same name, rehashing
+// only the nodes on its path
+void SparseMerkleTree::insert(const RecordPtr& record)
+{
+  Key key = getKey(record->getName());
+  SHA384_HASH value = record->getHash();
+
+  std::vector<Node*> path;  // branches above the change
+  std::unique_ptr<Node>* slot = &root_;
+  size_t topDepth = 0;
+  while (*slot)
+  {
+    Node* node = slot->get();
+    size_t prefix = getCommonPrefix(key, node->key);
+    if (prefix < node->depth)
+    {  // the key leaves this node's edge, so branch there
+      std::unique_ptr<Node> leaf(new Node());
+      leaf->depth = DEPTH;
+      leaf->key = key;
+      leaf->hash = value;
+      leaf->top = lift(value, key, DEPTH, prefix + 1);
+
+      std::unique_ptr<Node> branch(new Node());
+      branch->depth = prefix;
+      branch->key = key;
+      node->top = lift(node->hash, node->key, node->depth, prefix + 1);
+      bool bit = getBit(key, prefix);
+      branch->children[!bit] = std::move(*slot);
+      branch->children[bit] = std::move(leaf);
+      rehash(*branch, topDepth);
+      *slot = std::move(branch);
+      size_++;
+      break;
+    }
+
+    if (node->depth == DEPTH)
+    {  // same key, so replace the value
+      node->hash = value;
+      node->top = lift(value, key, DEPTH, topDepth);
+      break;
+    }
+
+    path.push_back(node);
+    topDepth = node->depth + 1;
+    slot = &node->children[getBit(key, node->depth)];
+  }
+
+  if (!root_)
+  {
+    root_.reset(new Node());
+    root_->depth = DEPTH;
+    root_->key = key;
+    root_->hash = value;
+    root_->top = lift(value, key, DEPTH, 0);
+    size_++;
+  }
+
+  for (size_t j = path.size(); j-- > 0;)
+    rehash(*path[j], j == 0 ? 0 : path[j - 1]->depth + 1);
+}
+
+
+
+// proves the name's presence or absence with the same fixed-depth shape: its
+// leaf value, zero if it is absent, a bitmap over the 256 levels marking the
+// siblings that are not default hashes, and those siblings from the bottom up
+Json::Value SparseMerkleTree::generateSubtree(const std::string& name) const
+{
+  Key key = getKey(name);
+  SHA384_HASH value;
+  value.fill(0);
+
+  std::vector<std::pair<size_t, SHA384_HASH> > siblings;  // by parent depth
+  const Node* node = root_.get();
+  while (node)
+  {
+    size_t prefix = getCommonPrefix(key, node->key);
+    if (prefix < node->depth)
+    {  // the name's path leaves this node's edge, which becomes its sibling
+      siblings.emplace_back(
+          prefix, lift(node->hash, node->key, node->depth, prefix + 1));
+      break;
+    }
+
+    if (node->depth == DEPTH)
+    {
+      value = node->hash;
+      break;
+    }
+
+    bool bit = getBit(key, node->depth);
+    siblings.emplace_back(node->depth, node->children[!bit]->top);
+    node = node->children[bit].get();
+  }
+
+  Key bitmap;
+  bitmap.fill(0);
+  Json::Value result;
+  result["name"] = name;
+  result["hash"] = encode(value.data(), value.size());
+  result["siblings"] = Json::Value(Json::arrayValue);
+  for (size_t j = siblings.size(); j-- > 0;)
+  {
+    size_t depth = siblings[j].first;
+    bitmap[depth / 8] |= static_cast<uint8_t>(0x80 >> (depth % 8));
+    result["siblings"].append(
+        encode(siblings[j].second.data(), Const::SHA384_LEN));
+  }
+
+  result["bitmap"] = encode(bitmap.data(), bitmap.size());
+  return result;
+}
+
+
+
+// tests whether the proof holds the Record; the root is checked separately
+bool SparseMerkleTree::doesContain(const Json::Value& proof,
+                                   const RecordPtr& record)
+{
+  SHA384_HASH value, root;
+  return walkPath(proof, value, root) &&
+         proof["name"].asString() == record->getName() &&
+         value == record->getHash();
+}
+
+
+
+// tests whether the proof shows that the name has an empty leaf
+bool SparseMerkleTree::doesExclude(const Json::Value& proof,
+                                   const std::string& name)
+{
+  SHA384_HASH value, root, empty;
+  empty.fill(0);
+  return walkPath(proof, value, root) && proof["name"].asString() == name &&
+         value == empty;
+}
+
+
+
+SHA384_HASH SparseMerkleTree::extractRoot(const Json::Value& proof)
+{
+  SHA384_HASH value, root;
+  if (!walkPath(proof, value, root))
+  {
+    Log::get().warn("Invalid sparse Merkle proof.");
+    root.fill(0);
+  }
+
+  return root;
+}
+
+
+
+SHA384_HASH SparseMerkleTree::getRootHash() const
+{
+  if (root_)
+    return root_->top;
+  return getDefaults()[DEPTH];
+}
+
+
+
+size_t SparseMerkleTree::getSize() const
+{
+  return size_;
+}
+
+
+
+// ************************** PRIVATE METHODS **************************** //
+
+
+
+// builds the trie over the sorted leaves in [begin, end), lifting its root up
+// to topDepth
+std::unique_ptr<SparseMerkleTree::Node> SparseMerkleTree::build(
+    const std::vector<Leaf>& leaves,
+    size_t begin,
+    size_t end,
+    size_t topDepth)
+{
+  std::unique_ptr<Node> node(new Node());
+  node->key = leaves[begin].first;
+  if (end - begin == 1)
+  {
+    node->depth = DEPTH;
+    node->hash = leaves[begin].second;
+    node->top = lift(node->hash, node->key, DEPTH, topDepth);
+    return node;
+  }
+
+  // sorted, so the range branches where its first and last keys differ
+  node->depth = getCommonPrefix(leaves[begin].first, leaves[end - 1].first);
+  if (node->depth == DEPTH)
+    Log::get().error("Sparse Merkle key collision.");
+
+  size_t depth = node->depth;
+  auto split = std::partition_point(leaves.begin() + begin,
+                                    leaves.begin() + end,
+                                    [depth](const Leaf& leaf)
+                                    {
+                                      return !getBit(leaf.first, depth);
+                                    });
+  size_t middle = static_cast<size_t>(split - leaves.begin());
+
+  node->children[0] = build(leaves, begin, middle, depth + 1);
+  node->children[1] = build(leaves, middle, end, depth + 1);
+  rehash(*node, topDepth);
+  return node;
+}
+
+
+
+// recomputes a branch from its children's tops, then lifts it to topDepth
+void SparseMerkleTree::rehash(Node& node, size_t topDepth)
+{
+  node.hash = MultiSHA384::hash(node.children[0]->top, node.children[1]->top);
+  node.top = lift(node.hash, node.key, node.depth, topDepth);
+}
+
+
+
+// recomputes the root from the leaf value and its 256 siblings, taking the
+// default hash wherever the bitmap is clear; every proof takes the same steps
+bool SparseMerkleTree::walkPath(const Json::Value& proof,
+                                SHA384_HASH& value,
+                                SHA384_HASH& root)
+{
+  Key bitmap;
+  if (!proof.isObject() || !proof["name"].isString() ||
+      !proof["siblings"].isArray() ||
+      !decode(proof["hash"], value.data(), value.size()) ||
+      !decode(proof["bitmap"], bitmap.data(), bitmap.size()))
+    return false;
+
+  const Json::Value& siblings = proof["siblings"];
+  const auto& defaults = getDefaults();
+  Key key = getKey(proof["name"].asString());
+
+  Json::ArrayIndex next = 0;
+  SHA384_HASH hash = value, sibling;
+  for (size_t depth = DEPTH; depth-- > 0;)
+  {
+    if (bitmap[depth / 8] & (0x80 >> (depth % 8)))
+    {
+      if (next >= siblings.size() ||
+          !decode(siblings[next++], sibling.data(), sibling.size()))
+        return false;
+    }
+    else
+      sibling = defaults[DEPTH - depth - 1];
+
+    hash = getBit(key, depth) ? MultiSHA384::hash(sibling, hash)
+                              : MultiSHA384::hash(hash, sibling);
+  }
+
+  root = hash;
+  return next == siblings.size();
+}
+
+
+
+// hashes up from the node at depth "from" to depth "to", through levels where
+// the other side is empty
+SHA384_HASH SparseMerkleTree::lift(SHA384_HASH hash,
+                                   const Key& key,
+                                   size_t from,
+                                   size_t to)
+{
+  const auto& defaults = getDefaults();
+  for (size_t depth = from; depth-- > to;)
+  {
+    const auto& empty = defaults[DEPTH - depth - 1];
+    hash = getBit(key, depth) ? MultiSHA384::hash(empty, hash)
+                              : MultiSHA384::hash(hash, empty);
+  }
+
+  return hash;
+}
+
+
+
+// the hash of an empty subtree of each height: zero for a leaf, and then the
+// hash of two copies of the height below
+const std::vector<SHA384_HASH>& SparseMerkleTree::getDefaults()
+{
+  static const std::vector<SHA384_HASH> defaults = []()
+  {
+    std::vector<SHA384_HASH> hashes(DEPTH + 1);
+    hashes[0].fill(0);
+    for (size_t level = 1; level <= DEPTH; level++)
+      hashes[level] = MultiSHA384::hash(hashes[level - 1], hashes[level - 1]);
+    return hashes;
+  }();
+
+  return defaults;
+}
+
+
+
+SparseMerkleTree::Key SparseMerkleTree::getKey(const std::string& name)
+{
+  Botan::SHA_384 sha;
+  auto hash = sha.process(name);
+
+  Key key;
+  memcpy(key.data(), hash.data(), key.size());
+  return key;
+}
+
+
+
+// the bit that chooses the child below the given depth, from the top
+bool SparseMerkleTree::getBit(const Key& key, size_t depth)
+{
+  return key[depth / 8] >> (7 - depth % 8) & 1;
+}
+
+
+
+size_t SparseMerkleTree::getCommonPrefix(const Key& a, const Key& b)
+{
+  for (size_t j = 0; j < a.size(); j++)
+  {
+    uint8_t diff = a[j] ^ b[j];
+    if (diff != 0)
+      return j * 8 + static_cast<size_t>(__builtin_clz(diff) - 24);
+  }
+
+  return DEPTH;
+}
+
+
+
+bool SparseMerkleTree::decode(const Json::Value& value,
+                              uint8_t* out,
+                              size_t length)
+{
+  if (!value.isString() || value.asString().size() != (length + 2) / 3 * 4)
+    return false;  // base64 of exactly length bytes
+
+  return Botan::base64_decode(out, value.asString()) == length;
+}
+
+
+
+std::string SparseMerkleTree::encode(const uint8_t* data, size_t length)
+{
+  return Botan::base64_encode(data, length);
+}
@@ -0,0 +1,64 @@
+
+#ifndef SPARSE_MERKLE_TREE_HPP
+#define SPARSE_MERKLE_TREE_HPP
+
+#include "records/Record.hpp"
+#include "../Constants.hpp"
+#include <json/json.h>
+#include <vector>
+#include <memory>
+#include <string>
+#include <array>
+
+// A Merkle tree over all 2^256 keys, where a name's key is the first 256
+// bits of its SHA-384 hash. Every leaf sits at the same depth and empty
+// subtrees take precomputed default hashes, so inclusion and exclusion proofs
+// have the same fixed shape: a leaf value, which is zero for an absent name,
+// and a bitmap of which of the 256 siblings are not defaults. In memory, the
+// tree is held as a compressed trie of only the leaves and the branch nodes.
+class SparseMerkleTree
+{
+ public:
+  SparseMerkleTree(const std::vector<RecordPtr>&);
+  void insert(const RecordPtr&);
+  Json::Value generateSubtree(const std::string&) const;
+  static bool doesContain(const Json::Value&, const RecordPtr&);
+  static bool doesExclude(const Json::Value&, const std::string&);
+  static SHA384_HASH extractRoot(const Json::Value&);
+  SHA384_HASH getRootHash() const;
+  size_t getSize() const;
+
+ private:
+  static const size_t DEPTH = 256;
+  typedef std::array<uint8_t, DEPTH / 8> Key;
+
+  struct Node
+  {  // a leaf sits at DEPTH, and a branch has two children
+    size_t depth;
+    Key key;           // of the leaf, or of any leaf below the branch
+    SHA384_HASH hash;  // at the node's own depth
+    SHA384_HASH top;   // lifted through empty levels to below its parent
+    std::unique_ptr<Node> children[2];
+  };
+
+  typedef std::pair<Key, SHA384_HASH> Leaf;
+
+  static std::unique_ptr<Node> build(const std::vector<Leaf>&,
+                                     size_t,
+                                     size_t,
+                                     size_t);
+  static void rehash(Node&, size_t);
+  static bool walkPath(const Json::Value&, SHA384_HASH&, SHA384_HASH&);
+  static SHA384_HASH lift(SHA384_HASH, const Key&, size_t, size_t);
+  static const std::vector<SHA384_HASH>& getDefaults();
+  static Key getKey(const std::string&);
+  static bool getBit(const Key&, size_t);
+  static size_t getCommonPrefix(const Key&, const Key&);
+  static bool decode(const Json::Value&, uint8_t*, size_t);
+  static std::string encode(const uint8_t*, size_t);
+
+  std::unique_ptr<Node> root_;
+  size_t size_;
+};
+
+#endif
@@ -0,0 +1,93 @@
+#include "StrataEstimator.hpp"
+#include "../Log.hpp"
+
+
+StrataEstimator::StrataEstimator()
+    : strata_(N_STRATA, InvertibleBloomTable(STRATUM_CELLS))
+{
+}
+
+
+
+void StrataEstimator::insert(uint64_t key)
+{
+  strata_[getStratum(key)].insert(key);
+}
+
+
+
+void StrataEstimator::erase(uint64_t key)
+{
+  strata_[getStratum(key)].erase(key);
+}
+
+
+
+// decodes the strata from the sparsest down, and once one fails, scales the
+// count of those above it by the fraction of keys they sample
+size_t StrataEstimator::estimate(const StrataEstimator& other) const
+{
+  size_t count = 0;
+  for (size_t j = N_STRATA; j-- > 0;)
+  {
+    InvertibleBloomTable difference(strata_[j]);
+    difference.subtract(other.strata_[j]);
+
+    std::vector<uint64_t> positive, negative;
+    if (!difference.decode(positive, negative))
+      return (count + 1) << (j + 1);  // at least one, as this one is not empty
+    count += positive.size() + negative.size();
+  }
+
+  return count;
+}
+
+
+
+Json::Value StrataEstimator::asJSON() const
+{
+  Json::Value value(Json::arrayValue);
+  for (const auto& stratum : strata_)
+    value.append(stratum.asJSON());
+  return value;
+}
+
+
+
+// the estimator comes from the other side, so each stratum must be a table of
+// exactly the size of ours
+StrataEstimator StrataEstimator::fromJSON(const Json::Value& value)
+{
+  if (!value.isArray() || value.size() != N_STRATA)
+    Log::get().error("Invalid number of strata in estimator.");
+
+  StrataEstimator estimator;
+  for (Json::ArrayIndex j = 0; j < N_STRATA; j++)
+  {
+    auto stratum = InvertibleBloomTable::fromJSON(value[j]);
+    if (stratum.getCellCount() != STRATUM_CELLS)
+      Log::get().error("Invalid size of stratum in estimator.");
+    estimator.strata_[j] = stratum;
+  }
+
+  return estimator;
+}
+
+
+
+// ************************** PRIVATE METHODS **************************** //
+
+
+
+// keys are already uniform hashes, so their trailing zeros pick the stratum
+size_t StrataEstimator::getStratum(uint64_t key)
+{
+  size_t stratum = 0;
+  while (stratum + 1 < N_STRATA && (key & 1) == 0)
+  {
+    key >>= 1;
+    stratum++;
+  }
+
+  return stratum;
+}
@@ -0,0 +1,35 @@
+#ifndef STRATA_ESTIMATOR_HPP
+#define STRATA_ESTIMATOR_HPP
+
+#include "InvertibleBloomTable.hpp"
+#include <json/json.h>
+#include <vector>
+#include <cstdint>
+
+// Estimates the size of the symmetric difference between two sets from about
+// 11 KB of tables, so that the invertible Bloom table sent afterwards can be
+// sized for it. Keys are split into strata by their trailing zero bits, so
+// stratum i samples about 1 in 2^(i+1) of them; each stratum is a small table,
+// and the sparse ones that still decode are scaled up to estimate the rest.
+// https://www.ics.uci.edu/~eppstein/pubs/EppGooUye-SIGCOMM-11.pdf
+class StrataEstimator
+{
+ public:
+  StrataEstimator();
+  void insert(uint64_t);
+  void erase(uint64_t);
+  size_t estimate(const StrataEstimator&) const;
+
+  Json::Value asJSON() const;
+  static StrataEstimator fromJSON(const Json::Value&);
+
+ private:
+  static size_t getStratum(uint64_t);
+
+  static const size_t N_STRATA = 16;
+  static const size_t STRATUM_CELLS = 36;
+
+  std::vector<InvertibleBloomTable> strata_;
+};
+
+#endif
@@ -0,0 +1,438 @@
+
+#include "VersionedMerkleTree.hpp"
+#include "MerkleTree.hpp"
+#include "../Log.hpp"
+#include "../crypto/MultiSHA384.hpp"
+#include <botan/base64.h>
+#include <unordered_set>
+#include <algorithm>
+
+
+// records must be sorted by name
+VersionedMerkleTree::VersionedMerkleTree(const std::vector<RecordPtr>& records)
+    : latest_(0)
+{
+  Rebuild rebuild;
+  rebuild.shifted = 0;
+  rebuild.widths = getWidths(records.size());
+  for (auto r : records)
+    rebuild.suffix.push_back(makeLeaf(r));
+
+  Version version;
+  version.size = records.size();
+  version.depth = rebuild.widths.size() - 1;
+  if (version.size > 0)
+    version.root = build(rebuild, version.depth, 0);
+  versions_[0] = version;
+}
+
+
+
+// applies a batch of added or replaced Records as a new version, sharing all
+// untouched subtrees with the latest one. A replacement copies only its path,
+// but since leaves are positional, a new name shifts every leaf after it, so
+// the nodes above that suffix are rebuilt, although its leaves are reused
+size_t VersionedMerkleTree::commit(const std::vector<RecordPtr>& records)
+{
+  std::lock_guard<std::mutex> commitLock(commitMutex_);
+
+  auto batch = MerkleTree::sortBatch(records);
+
+  Version base = getVersion(getLatest());
+  Version next = base;
+  std::vector<NodePtr> added;
+  size_t shifted = base.size;
+  for (auto r : batch)
+  {
+    bool found;
+    size_t index = locate(base, r->getName(), found);
+    if (found)
+      next.root = replace(next.root, next.depth, index, makeLeaf(r));
+    else
+    {
+      shifted = std::min(shifted, index);
+      added.push_back(makeLeaf(r));
+    }
+  }
+
+  if (!added.empty())
+  {  // merge the new leaves into the shifted suffix and rebuild above it
+    std::vector<NodePtr> suffix;
+    if (next.root)
+      collect(next.root, next.depth, 0, shifted, suffix);
+
+    Rebuild rebuild;
+    rebuild.old = next;
+    rebuild.shifted = shifted;
+    rebuild.suffix.resize(suffix.size() + added.size());
+    std::merge(suffix.begin(), suffix.end(), added.begin(), added.end(),
+               rebuild.suffix.begin(), [](const NodePtr& a, const NodePtr& b)
+               {
+                 return a->name < b->name;
+               });
+
+    next.size = base.size + added.size();
+    rebuild.widths = getWidths(next.size);
+    next.depth = rebuild.widths.size() - 1;
+    next.root = build(rebuild, next.depth, 0);
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  versions_[++latest_] = next;
+  Log::get().notice("Committed version " + std::to_string(latest_) +
+                    " of Merkle tree with " + std::to_string(next.size) +
+                    " leaves.");
+  return latest_;
+}
+
+
+
+// the same path or span as MerkleTree::generateSubtree, against the version
+Json::Value VersionedMerkleTree::generateSubtree(const std::string& domain,
+                                                 size_t versionId) const
+{
+  Version version = getVersion(versionId);
+  Json::Value result;
+  if (version.size == 0)
+    return result;
+
+  bool found;
+  size_t index = locate(version, domain, found);
+  if (found)
+    return generatePath(getPath(version, index), version.depth);
+
+  if (index == 0)
+    result["right"] = generateBranch(getPath(version, index), version.depth);
+  else if (index == version.size)
+    result["left"] = generateBranch(getPath(version, index - 1), version.depth);
+  else
+  {  // the branches stop below their lowest common ancestor
+    size_t height = 0;
+    for (size_t diff = (index - 1) ^ index; diff > 0; diff >>= 1)
+      height++;
+
+    auto left = getPath(version, index - 1), right = getPath(version, index);
+    result["left"] = generateBranch(left, height - 1);
+    result["right"] = generateBranch(right, height - 1);
+    result["common"] = Json::Value(Json::arrayValue);
+    appendNodes(right, height, version.depth, result["common"]);
+  }
+
+  return result;
+}
+
+
+
+SHA384_HASH VersionedMerkleTree::getRootHash(size_t versionId) const
+{
+  Version version = getVersion(versionId);
+  SHA384_HASH root;
+  if (version.root)
+    root = version.root->hash;
+  else
+    root.fill(0);
+  return root;
+}
+
+
+
+size_t VersionedMerkleTree::getSize(size_t versionId) const
+{
+  return getVersion(versionId).size;
+}
+
+
+
+size_t VersionedMerkleTree::getLatest() const
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  return latest_;
+}
+
+
+
+std::vector<size_t> VersionedMerkleTree::getVersions() const
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::vector<size_t> ids;
+  for (const auto& entry : versions_)
+    ids.push_back(entry.first);
+  return ids;
+}
+
+
+
+// drops all but the newest versions; nodes that no remaining version shares
+// are freed as their last reference goes
+void VersionedMerkleTree::prune(size_t keep)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  while (versions_.size() > std::max<size_t>(keep, 1))
+    versions_.erase(versions_.begin());
+}
+
+
+
+size_t VersionedMerkleTree::getNodeCount() const
+{
+  std::vector<const Node*> pending;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (const auto& entry : versions_)
+      if (entry.second.root)
+        pending.push_back(entry.second.root.get());
+  }
+
+  std::unordered_set<const Node*> seen;
+  while (!pending.empty())
+  {
+    const Node* node = pending.back();
+    pending.pop_back();
+    if (!seen.insert(node).second)
+      continue;  // shared, so everything below was already counted
+
+    if (node->left)
+      pending.push_back(node->left.get());
+    if (node->right)
+      pending.push_back(node->right.get());
+  }
+
+  return seen.size();
+}
+
+
+
+// ************************** PRIVATE METHODS **************************** //
+
+
+
+// copies the version out, so that the caller can walk its immutable nodes
+// without holding the lock
+VersionedMerkleTree::Version VersionedMerkleTree::getVersion(size_t id) const
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto iter = versions_.find(id);
+  if (iter == versions_.end())
+    Log::get().error("Unknown Merkle tree version " + std::to_string(id));
+  return iter->second;
+}
+
+
+
+VersionedMerkleTree::NodePtr VersionedMerkleTree::makeLeaf(
+    const RecordPtr& record)
+{
+  auto leaf = std::make_shared<Node>();
+  leaf->hash = record->getHash();
+  leaf->record = record;
+  leaf->name = record->getName();
+  leaf->first = &leaf->name;
+  return leaf;
+}
+
+
+
+// hashes left and right, or left twice if there is no right
+VersionedMerkleTree::NodePtr VersionedMerkleTree::makeNode(
+    const NodePtr& left,
+    const NodePtr& right)
+{
+  auto node = std::make_shared<Node>();
+  node->hash = MultiSHA384::hash(left->hash, right ? right->hash : left->hash);
+  node->left = left;
+  node->right = right;
+  node->first = left->first;
+  return node;
+}
+
+
+
+// builds the node at the level and index; one whose leaves all come before
+// the shifted suffix is unchanged, so it is taken from the old tree
+VersionedMerkleTree::NodePtr VersionedMerkleTree::build(const Rebuild& rebuild,
+                                                        size_t level,
+                                                        size_t j)
+{
+  if (((j + 1) << level) <= rebuild.shifted)
+    return findNode(rebuild.old, level, j);
+
+  if (level == 0)
+    return rebuild.suffix[j - rebuild.shifted];
+
+  NodePtr left = build(rebuild, level - 1, 2 * j), right;
+  if (2 * j + 1 < rebuild.widths[level - 1])
+    right = build(rebuild, level - 1, 2 * j + 1);
+  return makeNode(left, right);
+}
+
+
+
+// copies the path from the node down to the leaf at the index, which is
+// replaced; everything beside the path is shared
+VersionedMerkleTree::NodePtr VersionedMerkleTree::replace(
+    const NodePtr& node,
+    size_t level,
+    size_t index,
+    const NodePtr& leaf)
+{
+  if (level == 0)
+    return leaf;
+
+  if (index >> (level - 1) & 1)
+    return makeNode(node->left, replace(node->right, level - 1, index, leaf));
+  return makeNode(replace(node->left, level - 1, index, leaf), node->right);
+}
+
+
+
+// the node at the level and index, found by descending from the root
+VersionedMerkleTree::NodePtr VersionedMerkleTree::findNode(
+    const Version& version,
+    size_t level,
+    size_t j)
+{
+  const NodePtr* node = &version.root;
+  for (size_t l = version.depth; l > level; l--)
+    node = (j >> (l - 1 - level) & 1) ? &(*node)->right : &(*node)->left;
+  return *node;
+}
+
+
+
+// appends the leaves below the node, at the level and index, from the given
+// leaf index onwards
+void VersionedMerkleTree::collect(const NodePtr& node,
+                                  size_t level,
+                                  size_t j,
+                                  size_t from,
+                                  std::vector<NodePtr>& out)
+{
+  if (((j + 1) << level) <= from)
+    return;
+
+  if (level == 0)
+    out.push_back(node);
+  else
+  {
+    collect(node->left, level - 1, 2 * j, from, out);
+    if (node->right)
+      collect(node->right, level - 1, 2 * j + 1, from, out);
+  }
+}
+
+
+
+// returns the index of the first leaf whose name is not less than the given
+// one, noting whether it is that name, by following the first names of each
+// right child down to the last leaf that is not after it
+size_t VersionedMerkleTree::locate(const Version& version,
+                                   const std::string& name,
+                                   bool& found)
+{
+  found = false;
+  if (!version.root)
+    return 0;
+
+  const Node* node = version.root.get();
+  size_t index = 0;
+  for (size_t level = version.depth; level > 0; level--)
+  {
+    index <<= 1;
+    if (node->right && !(name < *node->right->first))
+    {
+      node = node->right.get();
+      index |= 1;
+    }
+    else
+      node = node->left.get();
+  }
+
+  found = node->name == name;
+  return node->name < name ? index + 1 : index;
+}
+
+
+
+// the number of nodes at each level, from the leaves up to the root
+std::vector<size_t> VersionedMerkleTree::getWidths(size_t size)
+{
+  std::vector<size_t> widths(1, size);
+  while (widths.back() > 1)
+    widths.push_back((widths.back() + 1) / 2);
+  return widths;
+}
+
+
+
+// the nodes from the leaf at the index up to the root
+std::vector<const VersionedMerkleTree::Node*> VersionedMerkleTree::getPath(
+    const Version& version,
+    size_t index)
+{
+  std::vector<const Node*> path(version.depth + 1);
+  path[version.depth] = version.root.get();
+  for (size_t level = version.depth; level > 0; level--)
+    path[level - 1] = (index >> (level - 1) & 1) ? path[level]->right.get()
+                                                 : path[level]->left.get();
+  return path;
+}
+
+
+
+// the leaf followed by its ancestors up to the given level
+Json::Value VersionedMerkleTree::generatePath(
+    const std::vector<const Node*>& path,
+    size_t depth)
+{
+  Json::Value result;
+
+  Json::Value leafVal;
+  leafVal["name"] = path[0]->name;
+  leafVal["hash"] = Botan::base64_encode(path[0]->hash.data(),
+                                         Const::SHA384_LEN);
+  result.append(leafVal);
+
+  appendNodes(path, 0, depth, result);
+  return result;
+}
+
+
+
+// as above, but the leaf is given as its Record, as MerkleTree::generateSpan
+// gives the branches of a span
+Json::Value VersionedMerkleTree::generateBranch(
+    const std::vector<const Node*>& path,
+    size_t depth)
+{
+  Json::Value result;
+
+  Json::Value leafVal;
+  leafVal["record"] = path[0]->record->asJSON();
+  result.append(leafVal);
+
+  appendNodes(path, 0, depth, result);
+  return result;
+}
+
+
+
+// appends the ancestors along the path above each level in the range, each
+// listing the hashes of its children
+void VersionedMerkleTree::appendNodes(const std::vector<const Node*>& path,
+                                      size_t from,
+                                      size_t to,
+                                      Json::Value& out)
+{
+  for (size_t level = from; level < to; level++)
+  {
+    const Node* parent = path[level + 1];
+
+    Json::Value node;
+    node["left"] =
+        Botan::base64_encode(parent->left->hash.data(), Const::SHA384_LEN);
+    if (parent->right)
+      node["right"] =
+          Botan::base64_encode(parent->right->hash.data(), Const::SHA384_LEN);
+    out.append(node);
+  }
+}
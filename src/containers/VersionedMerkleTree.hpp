@@ -0,0 +1,87 @@
+
+#ifndef VERSIONED_MERKLE_TREE_HPP
+#define VERSIONED_MERKLE_TREE_HPP
+
+#include "records/Record.hpp"
+#include "../Constants.hpp"
+#include <json/json.h>
+#include <mutex>
+#include <vector>
+#include <memory>
+#include <string>
+#include <map>
+
+// A Merkle tree that keeps several versions at once. Nodes are immutable, so
+// each commit copies only the paths to the leaves that it changes and shares
+// every other subtree with the version before it. Roots and proofs match
+// those of a MerkleTree over the same Records, and each retained version can
+// still be proven against after newer ones are committed.
+class VersionedMerkleTree
+{
+ public:
+  VersionedMerkleTree(const std::vector<RecordPtr>&);  // sorted, version 0
+  size_t commit(const std::vector<RecordPtr>&);
+  Json::Value generateSubtree(const std::string&, size_t) const;
+  SHA384_HASH getRootHash(size_t) const;
+  size_t getSize(size_t) const;
+  size_t getLatest() const;
+  std::vector<size_t> getVersions() const;
+  void prune(size_t);           // keeps only the newest versions
+  size_t getNodeCount() const;  // distinct nodes across retained versions
+
+ private:
+  struct Node;
+  typedef std::shared_ptr<const Node> NodePtr;
+
+  struct Node
+  {  // only a leaf has a name and a Record, for spans, and an odd node has
+     // no right child
+    SHA384_HASH hash;
+    NodePtr left, right;
+    std::string name;
+    RecordPtr record;
+    const std::string* first;  // the name of the leftmost leaf below
+  };
+
+  struct Version
+  {
+    NodePtr root;
+    size_t size, depth;
+  };
+
+  struct Rebuild
+  {  // leaves from shifted onwards are given, the rest are reused from old
+    Version old;
+    size_t shifted;
+    std::vector<NodePtr> suffix;
+    std::vector<size_t> widths;  // of each level of the new tree
+  };
+
+  Version getVersion(size_t) const;
+  static NodePtr makeLeaf(const RecordPtr&);
+  static NodePtr makeNode(const NodePtr&, const NodePtr&);
+  static NodePtr build(const Rebuild&, size_t, size_t);
+  static NodePtr replace(const NodePtr&, size_t, size_t, const NodePtr&);
+  static NodePtr findNode(const Version&, size_t, size_t);
+  static void collect(const NodePtr&,
+                      size_t,
+                      size_t,
+                      size_t,
+                      std::vector<NodePtr>&);
+  static size_t locate(const Version&, const std::string&, bool&);
+  static std::vector<size_t> getWidths(size_t);
+  static std::vector<const Node*> getPath(const Version&, size_t);
+  static Json::Value generatePath(const std::vector<const Node*>&, size_t);
+  static Json::Value generateBranch(const std::vector<const Node*>&, size_t);
+  static void appendNodes(const std::vector<const Node*>&,
+                          size_t,
+                          size_t,
+                          Json::Value&);
+
+  std::mutex commitMutex_;    // commits build on the latest version in turn
+  mutable std::mutex mutex_;  // guards versions_, not the nodes
+  std::map<size_t, Version> versions_;
+  size_t latest_;
+};
+
+#endif
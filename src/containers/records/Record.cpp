@@ -12,7 +12,11 @@
 
 
 Record::Record(Botan::RSA_PublicKey* pubKey)
-    : privateKey_(nullptr), publicKey_(pubKey), valid_(false), validSig_(false)
+    : privateKey_(nullptr),
+      publicKey_(pubKey),
+      valid_(false),
+      validSig_(false),
+      nSubdomains_(0)
 {
   nonce_.fill(0);
   scrypted_.fill(0);
@@ -37,18 +41,22 @@ Record::Record(Botan::RSA_PrivateKey* key)
 
 
 Record::Record(const Record& other)
-    : type_(other.type_),
-      name_(other.name_),
+    : name_(other.name_),
+      type_(other.type_),
       contact_(other.contact_),
-      subdomains_(other.subdomains_),
+      subdomains_(other.nSubdomains_ > 0 ? new Subdomain[other.nSubdomains_]
+                                         : nullptr),
       privateKey_(other.privateKey_),
       publicKey_(other.publicKey_),
       nonce_(other.nonce_),
       scrypted_(other.scrypted_),
       signature_(other.signature_),
       valid_(other.valid_),
-      validSig_(other.validSig_)
+      validSig_(other.validSig_),
+      nSubdomains_(other.nSubdomains_)
 {
+  std::copy(other.subdomains_.get(), other.subdomains_.get() + nSubdomains_,
+            subdomains_.get());
 }
 
 
@@ -75,7 +83,7 @@ void Record::setName(const std::string& name)
 
 
 
-std::string Record::getName() const
+const std::string& Record::getName() const
 {
   return name_;
 }
@@ -103,7 +111,12 @@ void Record::setSubdomains(const NameList& subdomains)
       Log::get().error("Destination must go to .tor or .onion!");
   }
 
-  subdomains_ = subdomains;
+  subdomains_.reset(subdomains.empty() ? nullptr
+                                      : new Subdomain[subdomains.size()]);
+  nSubdomains_ = static_cast<uint8_t>(subdomains.size());
+  for (size_t j = 0; j < subdomains.size(); j++)
+    subdomains_[j] = std::make_pair(InternedString(subdomains[j].first),
+                                    InternedString(subdomains[j].second));
   valid_ = false;
 }
 
@@ -111,7 +124,28 @@ void Record::setSubdomains(const NameList& subdomains)
 
 NameList Record::getSubdomains() const
 {
-  return subdomains_;
+  NameList list;
+  list.reserve(nSubdomains_);
+  for (size_t j = 0; j < nSubdomains_; j++)
+    list.push_back(std::make_pair(subdomains_[j].first.str(),
+                                  subdomains_[j].second.str()));
+  return list;
+}
+
+
+
+size_t Record::getSubdomainCount() const
+{
+  return nSubdomains_;
+}
+
+
+
+// the handles themselves, so that callers can walk the subdomains without
+// copying them out into a NameList
+const Subdomain& Record::getSubdomain(size_t index) const
+{
+  return subdomains_[index];
 }
 
 
@@ -127,9 +161,9 @@ void Record::setContact(const std::string& contactInfo)
 
 
 
-std::string Record::getContact() const
+const std::string& Record::getContact() const
 {
-  return contact_;
+  return contact_.str();
 }
 
 
@@ -260,9 +294,9 @@ bool Record::hasValidSignature() const
 
 
 
-std::string Record::getType() const
+const std::string& Record::getType() const
 {
-  return type_;
+  return type_.str();
 }
 
 
@@ -278,14 +312,14 @@ Json::Value Record::asJSONObj() const
 {
   Json::Value obj;
 
-  obj["type"] = type_;
+  obj["type"] = type_.str();
   obj["name"] = name_;
   if (!contact_.empty())
-    obj["contact"] = contact_;
+    obj["contact"] = contact_.str();
 
   // add subdomains
-  for (auto sub : subdomains_)
-    obj["subd"][sub.first] = sub.second;
+  for (size_t j = 0; j < nSubdomains_; j++)
+    obj["subd"][subdomains_[j].first.str()] = subdomains_[j].second.str();
 
   // extract and save public key
   auto key = getPublicKey();
@@ -320,13 +354,13 @@ std::ostream& operator<<(std::ostream& os, const Record& dt)
      << (dt.valid_ ? "VALID)" : "INVALID)") << std::endl;
 
   os << "   Domain Information: " << std::endl;
-  os << "      " << dt.name_ << " -> " << dt.getOnion() << std::endl;
-  for (auto subd : dt.subdomains_)
-    os << "      " << subd.first << "." << dt.name_ << " -> " << subd.second
-       << std::endl;
+  os << "      " << dt.getName() << " -> " << dt.getOnion() << std::endl;
+  for (size_t j = 0; j < dt.nSubdomains_; j++)
+    os << "      " << dt.subdomains_[j].first.str() << "." << dt.getName()
+       << " -> " << dt.subdomains_[j].second.str() << std::endl;
 
   if (dt.contact_.empty())
-    os << "   Contact: PGP 0x" << dt.contact_ << std::endl;
+    os << "   Contact: PGP 0x" << dt.getContact() << std::endl;
   os << "   Validation:" << std::endl;
 
   os << "   Nonce: ";
@@ -438,10 +472,10 @@ void Record::computeValidity(bool* abortSig)
 // scrypted_ and signature_ without buffer overflow
 UInt8Array Record::computeCentral()
 {
-  std::string str(type_ + name_);
-  for (auto pair : subdomains_)
-    str += pair.first + pair.second;
-  str += contact_;
+  std::string str(type_.str() + name_);
+  for (size_t j = 0; j < nSubdomains_; j++)
+    str += subdomains_[j].first.str() + subdomains_[j].second.str();
+  str += contact_.str();
 
   int index = 0;
   auto pubKey = getPublicKey();
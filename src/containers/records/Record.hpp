@@ -3,6 +3,7 @@
 #define RECORD_HPP
 
 #include "../../Constants.hpp"
+#include "StringPool.hpp"
 #include <botan/botan.h>
 #include <botan/rsa.h>
 #include <json/json.h>
@@ -12,6 +13,7 @@
 
 typedef std::pair<uint8_t*, size_t> UInt8Array;
 typedef std::vector<std::pair<std::string, std::string> > NameList;
+typedef std::pair<InternedString, InternedString> Subdomain;
 
 class Record
 {
@@ -29,13 +31,15 @@ class Record
   virtual ~Record();
 
   void setName(const std::string&);
-  std::string getName() const;
+  const std::string& getName() const;
 
   void setSubdomains(const NameList&);
   NameList getSubdomains() const;
+  size_t getSubdomainCount() const;
+  const Subdomain& getSubdomain(size_t) const;
 
   void setContact(const std::string&);
-  std::string getContact() const;
+  const std::string& getContact() const;
 
   bool setKey(Botan::RSA_PrivateKey*);
   UInt8Array getPublicKey() const;
@@ -47,7 +51,7 @@ class Record
   bool isValid() const;
   bool hasValidSignature() const;
 
-  std::string getType() const;
+  const std::string& getType() const;
   virtual uint32_t getDifficulty() const;
   virtual Json::Value asJSONObj() const;
   std::string asJSON() const;
@@ -60,8 +64,11 @@ class Record
   int updateAppendScrypt(UInt8Array& buffer);
   void updateValidity(const UInt8Array& buffer);
 
-  std::string type_, name_, contact_;
-  NameList subdomains_;
+  // the type, subdomains and destinations repeat across many Records, so
+  // they are interned; names are unique and stay inline
+  std::string name_;
+  InternedString type_, contact_;
+  std::unique_ptr<Subdomain[]> subdomains_;  // nSubdomains_ of them
 
   Botan::RSA_PrivateKey* privateKey_;
   Botan::RSA_PublicKey* publicKey_;
@@ -70,6 +77,7 @@ class Record
   std::array<uint8_t, Const::RECORD_SCRYPTED_LEN> scrypted_;
   std::array<uint8_t, Const::SIGNATURE_LEN> signature_;
   bool valid_, validSig_;
+  uint8_t nSubdomains_;  // at most 24, so it fits beside the flags
 };
 
 typedef std::shared_ptr<Record> RecordPtr;
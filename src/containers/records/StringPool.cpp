@@ -0,0 +1,130 @@
+
+#include "StringPool.hpp"
+#include <algorithm>
+#include <tuple>
+
+
+// returns the shared entry for the string, adding a reference to it
+StringPool::Entry* StringPool::acquire(const std::string& str)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+
+  auto iter = strings_.find(str);
+  if (iter == strings_.end())
+  {
+    iter = strings_.emplace(std::piecewise_construct,
+                            std::forward_as_tuple(str),
+                            std::forward_as_tuple(0)).first;
+    bytes_ += sizeof(Entry) + str.capacity();
+  }
+
+  iter->second++;
+  return &*iter;
+}
+
+
+
+// drops a reference, freeing the string when nothing refers to it
+void StringPool::release(Entry* entry)
+{
+  // decrementing under the lock keeps acquire() from reviving a dying entry
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (--entry->second == 0)
+  {
+    bytes_ -= sizeof(Entry) + entry->first.capacity();
+    strings_.erase(entry->first);
+  }
+}
+
+
+
+size_t StringPool::getCount() const
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  return strings_.size();
+}
+
+
+
+size_t StringPool::getSize() const
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  return bytes_ + strings_.bucket_count() * sizeof(void*);
+}
+
+
+
+// ************************** INTERNED STRING **************************** //
+
+
+
+InternedString::InternedString(const std::string& str)
+    : entry_(str.empty() ? nullptr : StringPool::get().acquire(str))
+{
+}
+
+
+
+InternedString::InternedString(const InternedString& other)
+    : entry_(other.entry_)
+{
+  if (entry_)
+    entry_->second++;  // safe without the lock, other holds a reference
+}
+
+
+
+// takes over the reference, so the count is untouched
+InternedString::InternedString(InternedString&& other) noexcept
+    : entry_(other.entry_)
+{
+  other.entry_ = nullptr;
+}
+
+
+
+InternedString::~InternedString()
+{
+  if (entry_)
+    StringPool::get().release(entry_);
+}
+
+
+
+InternedString& InternedString::operator=(const InternedString& other)
+{
+  if (entry_ != other.entry_)
+  {
+    if (other.entry_)
+      other.entry_->second++;
+    if (entry_)
+      StringPool::get().release(entry_);
+    entry_ = other.entry_;
+  }
+
+  return *this;
+}
+
+
+
+// other releases the reference this held, if any, when it goes
+InternedString& InternedString::operator=(InternedString&& other) noexcept
+{
+  std::swap(entry_, other.entry_);
+  return *this;
+}
+
+
+
+InternedString& InternedString::operator=(const std::string& str)
+{
+  return *this = InternedString(str);
+}
+
+
+
+const std::string& InternedString::str() const
+{
+  static const std::string EMPTY;
+  return entry_ ? entry_->first : EMPTY;
+}
@@ -0,0 +1,60 @@
+
+#ifndef STRING_POOL_HPP
+#define STRING_POOL_HPP
+
+#include <unordered_map>
+#include <atomic>
+#include <mutex>
+#include <string>
+
+// Interning arena for the names, destinations and type tags held by Records.
+// Each distinct string is stored once and freed when its last handle goes.
+class StringPool
+{
+ public:
+  typedef std::unordered_map<std::string, std::atomic<uint32_t> > Map;
+  typedef Map::value_type Entry;
+
+  static StringPool& get()
+  {  // never destroyed, so static Records can outlive other statics
+    static StringPool* instance = new StringPool();
+    return *instance;
+  }
+
+  Entry* acquire(const std::string&);
+  void release(Entry*);
+  size_t getCount() const;
+  size_t getSize() const;  // approximate bytes held
+
+ private:
+  StringPool() : bytes_(0) {}
+  StringPool(StringPool const&) = delete;
+  void operator=(StringPool const&) = delete;
+
+  mutable std::mutex mutex_;
+  Map strings_;
+  size_t bytes_;
+};
+
+// Compact, pointer-sized handle to a string in the StringPool.
+class InternedString
+{
+ public:
+  InternedString() : entry_(nullptr) {}
+  InternedString(const std::string&);
+  InternedString(const InternedString&);
+  InternedString(InternedString&&) noexcept;
+  ~InternedString();
+  InternedString& operator=(const InternedString&);
+  InternedString& operator=(InternedString&&) noexcept;
+  InternedString& operator=(const std::string&);
+
+  const std::string& str() const;
+  bool empty() const { return entry_ == nullptr; }
+  bool operator==(const InternedString& o) const { return entry_ == o.entry_; }
+
+ private:
+  StringPool::Entry* entry_;
+};
+
+#endif
@@ -0,0 +1,351 @@
+
+#include "MultiSHA384.hpp"
+#include <algorithm>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define MULTI_SHA384_AVX2
+#include <immintrin.h>
+#endif
+
+namespace
+{
+const uint64_t K[80] = {
+    0x428a2f98d728ae22ULL, 0x7137449123ef65cdULL, 0xb5c0fbcfec4d3b2fULL,
+    0xe9b5dba58189dbbcULL, 0x3956c25bf348b538ULL, 0x59f111f1b605d019ULL,
+    0x923f82a4af194f9bULL, 0xab1c5ed5da6d8118ULL, 0xd807aa98a3030242ULL,
+    0x12835b0145706fbeULL, 0x243185be4ee4b28cULL, 0x550c7dc3d5ffb4e2ULL,
+    0x72be5d74f27b896fULL, 0x80deb1fe3b1696b1ULL, 0x9bdc06a725c71235ULL,
+    0xc19bf174cf692694ULL, 0xe49b69c19ef14ad2ULL, 0xefbe4786384f25e3ULL,
+    0x0fc19dc68b8cd5b5ULL, 0x240ca1cc77ac9c65ULL, 0x2de92c6f592b0275ULL,
+    0x4a7484aa6ea6e483ULL, 0x5cb0a9dcbd41fbd4ULL, 0x76f988da831153b5ULL,
+    0x983e5152ee66dfabULL, 0xa831c66d2db43210ULL, 0xb00327c898fb213fULL,
+    0xbf597fc7beef0ee4ULL, 0xc6e00bf33da88fc2ULL, 0xd5a79147930aa725ULL,
+    0x06ca6351e003826fULL, 0x142929670a0e6e70ULL, 0x27b70a8546d22ffcULL,
+    0x2e1b21385c26c926ULL, 0x4d2c6dfc5ac42aedULL, 0x53380d139d95b3dfULL,
+    0x650a73548baf63deULL, 0x766a0abb3c77b2a8ULL, 0x81c2c92e47edaee6ULL,
+    0x92722c851482353bULL, 0xa2bfe8a14cf10364ULL, 0xa81a664bbc423001ULL,
+    0xc24b8b70d0f89791ULL, 0xc76c51a30654be30ULL, 0xd192e819d6ef5218ULL,
+    0xd69906245565a910ULL, 0xf40e35855771202aULL, 0x106aa07032bbd1b8ULL,
+    0x19a4c116b8d2d0c8ULL, 0x1e376c085141ab53ULL, 0x2748774cdf8eeb99ULL,
+    0x34b0bcb5e19b48a8ULL, 0x391c0cb3c5c95a63ULL, 0x4ed8aa4ae3418acbULL,
+    0x5b9cca4f7763e373ULL, 0x682e6ff3d6b2b8a3ULL, 0x748f82ee5defb2fcULL,
+    0x78a5636f43172f60ULL, 0x84c87814a1f0ab72ULL, 0x8cc702081a6439ecULL,
+    0x90befffa23631e28ULL, 0xa4506cebde82bde9ULL, 0xbef9a3f7b2c67915ULL,
+    0xc67178f2e372532bULL, 0xca273eceea26619cULL, 0xd186b8c721c0c207ULL,
+    0xeada7dd6cde0eb1eULL, 0xf57d4f7fee6ed178ULL, 0x06f067aa72176fbaULL,
+    0x0a637dc5a2c898a6ULL, 0x113f9804bef90daeULL, 0x1b710b35131c471bULL,
+    0x28db77f523047d84ULL, 0x32caab7b40c72493ULL, 0x3c9ebe0a15c9bebcULL,
+    0x431d67c49c100d4cULL, 0x4cc5d4becb3e42b6ULL, 0x597f299cfc657e2aULL,
+    0x5fcb6fab3ad6faecULL, 0x6c44198c4a475817ULL};
+
+const uint64_t IV[8] = {0xcbbb9d5dc1059ed8ULL, 0x629a292a367cd507ULL,
+                        0x9159015a3070dd17ULL, 0x152fecd8f70e5939ULL,
+                        0x67332667ffc00b31ULL, 0x8eb44a8768581511ULL,
+                        0xdb0c2e0d64f98fa7ULL, 0x47b5481dbefa4fa4ULL};
+
+// the padding that follows 96 bytes of message fills the block's last words
+const uint64_t PAD_WORD = 0x8000000000000000ULL;
+const uint64_t LENGTH_WORD = 96 * 8;  // in bits
+
+const size_t HALF_WORDS = Const::SHA384_LEN / 8;  // each input hash
+const size_t BLOCK_LEN = 128;
+const size_t DIGEST_WORDS = Const::SHA384_LEN / 8;
+
+uint64_t load(const uint8_t* bytes)
+{
+  uint64_t word = 0;
+  for (size_t j = 0; j < 8; j++)
+    word = word << 8 | bytes[j];
+  return word;
+}
+
+void store(uint64_t word, uint8_t* bytes)
+{
+  for (size_t j = 0; j < 8; j++)
+    bytes[j] = static_cast<uint8_t>(word >> (56 - 8 * j));
+}
+
+inline uint64_t rotr(uint64_t x, int n)
+{
+  return x >> n | x << (64 - n);
+}
+}
+
+
+
+SHA384_HASH MultiSHA384::hash(const SHA384_HASH& a, const SHA384_HASH& b)
+{
+  SHA384_HASH result;
+  compress(a.data(), b.data(), result.data());
+  return result;
+}
+
+
+
+// SHA-384 of a message of any length, such as a Record, one block at a time
+// and without allocating
+SHA384_HASH MultiSHA384::hash(const uint8_t* message, size_t length)
+{
+  uint64_t state[8], w[80];
+  std::copy(IV, IV + 8, state);
+
+  size_t whole = length / BLOCK_LEN;
+  for (size_t block = 0; block < whole; block++)
+  {
+    for (size_t j = 0; j < 16; j++)
+      w[j] = load(message + block * BLOCK_LEN + 8 * j);
+    compressBlock(w, state);
+  }
+
+  // the rest, a one bit, zeros, and the 128-bit length fill one or two blocks
+  uint8_t tail[2 * BLOCK_LEN] = {};
+  size_t rest = length - whole * BLOCK_LEN;
+  std::copy(message + whole * BLOCK_LEN, message + length, tail);
+  tail[rest] = 0x80;
+  size_t tailLen = rest + 1 + 16 <= BLOCK_LEN ? BLOCK_LEN : 2 * BLOCK_LEN;
+  store(static_cast<uint64_t>(length) >> 61, tail + tailLen - 16);
+  store(static_cast<uint64_t>(length) << 3, tail + tailLen - 8);
+  for (size_t block = 0; block < tailLen; block += BLOCK_LEN)
+  {
+    for (size_t j = 0; j < 16; j++)
+      w[j] = load(tail + block + 8 * j);
+    compressBlock(w, state);
+  }
+
+  SHA384_HASH result;
+  for (size_t j = 0; j < DIGEST_WORDS; j++)
+    store(state[j], result.data() + 8 * j);
+  return result;
+}
+
+
+
+// sets out[j] to the hash of row[2j] and row[2j + 1] for j in [begin, end),
+// pairing an odd last hash with itself as the Merkle tree does
+void MultiSHA384::hashRow(const SHA384_HASH* row,
+                          size_t rowSize,
+                          SHA384_HASH* out,
+                          size_t begin,
+                          size_t end)
+{
+  auto pair = [row, rowSize](size_t j, const uint8_t*& left,
+                             const uint8_t*& right)
+  {
+    left = row[2 * j].data();
+    right = row[std::min(2 * j + 1, rowSize - 1)].data();
+  };
+
+  size_t j = begin;
+  if (isVectorized())
+  {
+    for (; j + LANES <= end; j += LANES)
+    {
+      const uint8_t* lefts[LANES];
+      const uint8_t* rights[LANES];
+      uint8_t* digests[LANES];
+      for (size_t lane = 0; lane < LANES; lane++)
+      {
+        pair(j + lane, lefts[lane], rights[lane]);
+        digests[lane] = out[j + lane].data();
+      }
+
+      compress4(lefts, rights, digests);
+    }
+  }
+
+  for (; j < end; j++)
+  {
+    const uint8_t *left, *right;
+    pair(j, left, right);
+    compress(left, right, out[j].data());
+  }
+}
+
+
+
+bool MultiSHA384::isVectorized()
+{
+#ifdef MULTI_SHA384_AVX2
+  static const bool hasAVX2 = __builtin_cpu_supports("avx2");
+  return hasAVX2;
+#else
+  return false;
+#endif
+}
+
+
+
+// ************************** PRIVATE METHODS **************************** //
+
+
+
+// a single SHA-512 compression of left || right || padding from the SHA-384
+// initial state, see FIPS 180-4 sections 5.1.2, 5.3.4 and 6.4
+void MultiSHA384::compress(const uint8_t* left,
+                           const uint8_t* right,
+                           uint8_t* digest)
+{
+  uint64_t w[80];
+  for (size_t j = 0; j < HALF_WORDS; j++)
+  {
+    w[j] = load(left + 8 * j);
+    w[HALF_WORDS + j] = load(right + 8 * j);
+  }
+
+  w[12] = PAD_WORD;
+  w[13] = w[14] = 0;
+  w[15] = LENGTH_WORD;
+
+  uint64_t state[8];
+  std::copy(IV, IV + 8, state);
+  compressBlock(w, state);
+  for (size_t j = 0; j < DIGEST_WORDS; j++)
+    store(state[j], digest + 8 * j);
+}
+
+
+
+// expands the block's first 16 words in w and adds its compression to state
+void MultiSHA384::compressBlock(uint64_t* w, uint64_t* state)
+{
+  for (size_t j = 16; j < 80; j++)
+  {
+    uint64_t s0 = rotr(w[j - 15], 1) ^ rotr(w[j - 15], 8) ^ (w[j - 15] >> 7);
+    uint64_t s1 = rotr(w[j - 2], 19) ^ rotr(w[j - 2], 61) ^ (w[j - 2] >> 6);
+    w[j] = w[j - 16] + s0 + w[j - 7] + s1;
+  }
+
+  uint64_t a = state[0], b = state[1], c = state[2], d = state[3];
+  uint64_t e = state[4], f = state[5], g = state[6], h = state[7];
+  for (size_t j = 0; j < 80; j++)
+  {
+    uint64_t t1 = h + (rotr(e, 14) ^ rotr(e, 18) ^ rotr(e, 41)) +
+                  ((e & f) ^ (~e & g)) + K[j] + w[j];
+    uint64_t t2 = (rotr(a, 28) ^ rotr(a, 34) ^ rotr(a, 39)) +
+                  ((a & b) ^ (a & c) ^ (b & c));
+    h = g;
+    g = f;
+    f = e;
+    e = d + t1;
+    d = c;
+    c = b;
+    b = a;
+    a = t1 + t2;
+  }
+
+  uint64_t words[8] = {a, b, c, d, e, f, g, h};
+  for (size_t j = 0; j < 8; j++)
+    state[j] += words[j];
+}
+
+
+
+#ifdef MULTI_SHA384_AVX2
+
+namespace
+{
+typedef __m256i Lanes;  // one 64-bit word from each of four messages
+
+__attribute__((target("avx2"))) inline Lanes rotr4(Lanes x, int n)
+{
+  return _mm256_or_si256(_mm256_srli_epi64(x, n), _mm256_slli_epi64(x, 64 - n));
+}
+
+__attribute__((target("avx2"))) inline Lanes add4(Lanes x, Lanes y)
+{
+  return _mm256_add_epi64(x, y);
+}
+
+__attribute__((target("avx2"))) inline Lanes xor4(Lanes x, Lanes y, Lanes z)
+{
+  return _mm256_xor_si256(_mm256_xor_si256(x, y), z);
+}
+
+// loads the word at the offset in each of the four messages
+__attribute__((target("avx2"))) inline Lanes gather(
+    const uint8_t* const* messages,
+    size_t offset)
+{
+  return _mm256_set_epi64x(static_cast<int64_t>(load(messages[3] + offset)),
+                           static_cast<int64_t>(load(messages[2] + offset)),
+                           static_cast<int64_t>(load(messages[1] + offset)),
+                           static_cast<int64_t>(load(messages[0] + offset)));
+}
+}
+
+
+
+// compress() on four independent messages, one per 64-bit lane
+__attribute__((target("avx2"))) void MultiSHA384::compress4(
+    const uint8_t* const* lefts,
+    const uint8_t* const* rights,
+    uint8_t* const* digests)
+{
+  Lanes w[80];
+  for (size_t j = 0; j < HALF_WORDS; j++)
+  {
+    w[j] = gather(lefts, 8 * j);
+    w[HALF_WORDS + j] = gather(rights, 8 * j);
+  }
+
+  w[12] = _mm256_set1_epi64x(static_cast<int64_t>(PAD_WORD));
+  w[13] = w[14] = _mm256_setzero_si256();
+  w[15] = _mm256_set1_epi64x(static_cast<int64_t>(LENGTH_WORD));
+
+  for (size_t j = 16; j < 80; j++)
+  {
+    Lanes s0 = xor4(rotr4(w[j - 15], 1), rotr4(w[j - 15], 8),
+                    _mm256_srli_epi64(w[j - 15], 7));
+    Lanes s1 = xor4(rotr4(w[j - 2], 19), rotr4(w[j - 2], 61),
+                    _mm256_srli_epi64(w[j - 2], 6));
+    w[j] = add4(add4(w[j - 16], s0), add4(w[j - 7], s1));
+  }
+
+  Lanes iv[8];
+  for (size_t j = 0; j < 8; j++)
+    iv[j] = _mm256_set1_epi64x(static_cast<int64_t>(IV[j]));
+
+  Lanes a = iv[0], b = iv[1], c = iv[2], d = iv[3];
+  Lanes e = iv[4], f = iv[5], g = iv[6], h = iv[7];
+  for (size_t j = 0; j < 80; j++)
+  {
+    Lanes ch = _mm256_xor_si256(_mm256_and_si256(e, f),
+                                _mm256_andnot_si256(e, g));
+    Lanes maj = xor4(_mm256_and_si256(a, b), _mm256_and_si256(a, c),
+                     _mm256_and_si256(b, c));
+    Lanes k = _mm256_set1_epi64x(static_cast<int64_t>(K[j]));
+
+    Lanes t1 = add4(add4(h, xor4(rotr4(e, 14), rotr4(e, 18), rotr4(e, 41))),
+                    add4(add4(ch, k), w[j]));
+    Lanes t2 = add4(xor4(rotr4(a, 28), rotr4(a, 34), rotr4(a, 39)), maj);
+    h = g;
+    g = f;
+    f = e;
+    e = add4(d, t1);
+    d = c;
+    c = b;
+    b = a;
+    a = add4(t1, t2);
+  }
+
+  Lanes state[DIGEST_WORDS] = {a, b, c, d, e, f};
+  for (size_t j = 0; j < DIGEST_WORDS; j++)
+  {
+    uint64_t words[LANES];
+    _mm256_storeu_si256(reinterpret_cast<Lanes*>(words), add4(state[j], iv[j]));
+    for (size_t lane = 0; lane < LANES; lane++)
+      store(words[lane], digests[lane] + 8 * j);
+  }
+}
+
+#else
+
+void MultiSHA384::compress4(const uint8_t* const* lefts,
+                            const uint8_t* const* rights,
+                            uint8_t* const* digests)
+{
+  for (size_t lane = 0; lane < LANES; lane++)
+    compress(lefts[lane], rights[lane], digests[lane]);
+}
+
+#endif
@@ -0,0 +1,32 @@
+
+#ifndef MULTI_SHA384_HPP
+#define MULTI_SHA384_HPP
+
+#include "../Constants.hpp"
+#include <cstddef>
+
+// SHA-384 specialised for the 96-byte concatenation of two SHA-384 hashes,
+// the input of every interior Merkle node. With padding such a message is
+// exactly one 128-byte block, so each hash is a single compression. Rows are
+// hashed four messages at a time with AVX2 where the CPU supports it. Other
+// short messages, such as the Records that span proofs carry, are hashed
+// block by block without allocating.
+class MultiSHA384
+{
+ public:
+  static SHA384_HASH hash(const SHA384_HASH&, const SHA384_HASH&);
+  static SHA384_HASH hash(const uint8_t*, size_t);  // any short message
+  static void hashRow(const SHA384_HASH*, size_t, SHA384_HASH*, size_t, size_t);
+  static bool isVectorized();
+
+  static const size_t LANES = 4;
+
+ private:
+  static void compress(const uint8_t*, const uint8_t*, uint8_t*);
+  static void compressBlock(uint64_t*, uint64_t*);
+  static void compress4(const uint8_t* const*,
+                        const uint8_t* const*,
+                        uint8_t* const*);
+};
+
+#endif
@@ -20,18 +20,27 @@ AuthenticatedStream::AuthenticatedStream(const std::string& socksHost,
 
 
 
-Json::Value AuthenticatedStream::sendReceive(const std::string& type,
-                                             const std::string& msg)
+// checks the signature on the response to the request, so that pipelined
+// requests are verified just as those from sendReceive are; a server that
+// echoes the id signs it too, so a response cannot be passed off as the
+// answer to another request
+Json::Value AuthenticatedStream::receive(uint32_t id)
 {
-  Log::get().notice("AuthStream sendReceive called");
+  Log::get().notice("AuthStream receive called");
 
-  Json::Value received = TorStream::sendReceive(type, msg);
+  Json::Value received = TorStream::receive(id);
 
   if (!received.isMember("signature"))
   {
     received["type"] = "error";
     received["value"] = "Missing signature from server.";
   }
+  else if (received.isMember("id") &&
+           (!received["id"].isUInt() || received["id"].asUInt() != id))
+  {
+    received["type"] = "error";
+    received["value"] = "Response from server is for another request.";
+  }
 
   // if the error happened above or any other existing error happened
   if (received["type"].asString() == "error")
@@ -46,9 +55,11 @@ Json::Value AuthenticatedStream::sendReceive(const std::string& type,
     return received;
   }
 
-  // check signature on transmission
+  // check signature on transmission, including the id if it was echoed
   std::string data =
       received["type"].toStyledString() + received["value"].toStyledString();
+  if (received.isMember("id"))
+    data += received["id"].toStyledString();
   const uint8_t* bytes = reinterpret_cast<const uint8_t*>(data.c_str());
   int check =
       ed25519_sign_open(bytes, data.size(), publicKey_.data(), sig.data());
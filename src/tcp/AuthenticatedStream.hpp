@@ -16,7 +16,7 @@ class AuthenticatedStream : public TorStream
                       const std::string&,
                       ushort,
                       const std::string&);
-  Json::Value sendReceive(const std::string&, const std::string&);
+  Json::Value receive(uint32_t);
 
  private:
   ED_KEY publicKey_;
@@ -1,6 +1,7 @@
 
 #include "TorStream.hpp"
 #include "../Log.hpp"
+#include <algorithm>
 #include <chrono>
 #include <thread>
 
@@ -11,7 +12,11 @@ TorStream::TorStream(const std::string& socksHost,
                      ushort remotePort)
     : socket_(std::make_shared<boost::asio::ip::tcp::socket>(ios_)),
       socks_(std::make_shared<Socks5::Socks5>(*socket_)),
-      ready_(false)
+      ready_(false),
+      synId_(0),
+      confirmed_(false),
+      nextId_(0),
+      unreceived_(0)
 {
   boost::asio::ip::tcp::resolver resolver(ios_);
   boost::asio::ip::tcp::endpoint endpoint =
@@ -45,8 +50,9 @@ TorStream::TorStream(const std::string& socksHost,
 
 
 
-Json::Value TorStream::sendReceive(const std::string& type,
-                                   const std::string& msg)
+// writes the request without waiting for a response, returning its id; fails
+// if too many earlier requests still await receive()
+uint32_t TorStream::send(const std::string& type, const std::string& msg)
 {
   if (!ready_)
   {
@@ -54,31 +60,35 @@ Json::Value TorStream::sendReceive(const std::string& type,
     waitUntilReady();
   }
 
+  std::lock_guard<std::mutex> lock(sendMutex_);
+  if (unreceived_ >= MAX_UNRECEIVED)
+    Log::get().error("Too many requests await a response.");
+  uint32_t id = nextId_++;
+
   Json::Value outVal;
   outVal["type"] = type;
   outVal["value"] = msg;
+  outVal["id"] = id;
   Json::FastWriter writer;
   boost::asio::write(*socket_, boost::asio::buffer(writer.write(outVal)));
 
-  // read from socket until newline
-  Log::get().notice("Receiving response from remote host... ");
-  boost::asio::streambuf response;
-  boost::asio::read_until(*socket_, response, "\n");
+  outstanding_.push_back(id);
+  unreceived_++;
+  return id;
+}
 
-  // convert to string
-  std::istream is(&response);
-  std::string responseStr((std::istreambuf_iterator<char>(is)),
-                          std::istreambuf_iterator<char>());
 
-  // parse into JSON object
-  Json::Reader reader;
-  Json::Value responseVal;
-  if (!reader.parse(responseStr, responseVal))
-    responseVal["error"] = "Failed to parse response from server.";
 
-  if (!responseVal.isMember("type") || !responseVal.isMember("value"))
-    responseVal["error"] = "Invalid response from server.";
+// returns the response to the request, after checking the server's reply to
+// the SYN if this is the first
+Json::Value TorStream::receive(uint32_t id)
+{
+  std::lock_guard<std::mutex> lock(receiveMutex_);
+  if (!confirmed_)
+    confirmProtocol();
 
+  Log::get().notice("Receiving response from remote host... ");
+  Json::Value responseVal = takeResponse(id);
   Log::get().notice("I/O complete.");
 
   return responseVal;
@@ -86,6 +96,15 @@ Json::Value TorStream::sendReceive(const std::string& type,
 
 
 
+// a single round trip, once the stream is established
+Json::Value TorStream::sendReceive(const std::string& type,
+                                   const std::string& msg)
+{
+  return receive(send(type, msg));
+}
+
+
+
 SocketPtr TorStream::getSocket() const
 {
   return socket_;
@@ -104,12 +123,14 @@ boost::asio::io_service& TorStream::getIO()
 
 
 
+// checks the response to the SYN sent once the stream was established
 bool TorStream::confirmProtocol()
 {
-  auto response = sendReceive("SYN", "");
+  auto response = takeResponse(synId_);
   if (response["type"] == "success" && response["value"] == "ACK")
   {
     Log::get().notice("Server confirmed up.");
+    confirmed_ = true;
     return true;
   }
   else
@@ -148,8 +169,7 @@ void TorStream::contactCallback(Socks5::Error err,
   {
     // Log::get().notice("Stream established with remote host.");
     ready_ = true;
-    if (!confirmProtocol())
-      ready_ = false;
+    synId_ = send("SYN", "");  // answered ahead of the first query
   }
   else
   {
@@ -186,3 +206,66 @@ void TorStream::waitUntilReady() const
   while (!ready_)
     std::this_thread::sleep_for(time);
 }
+
+
+
+// returns the response to the request, reading and setting aside any that
+// arrive for other requests first; receiveMutex_ must be held
+Json::Value TorStream::takeResponse(uint32_t id)
+{
+  {
+    std::lock_guard<std::mutex> lock(sendMutex_);
+    if (!responses_.count(id) &&
+        std::find(outstanding_.begin(), outstanding_.end(), id) ==
+            outstanding_.end())
+      Log::get().error("No outstanding request " + std::to_string(id));
+  }
+
+  while (!responses_.count(id))
+  {
+    uint32_t answered;
+    Json::Value responseVal = readResponse(answered);
+    responses_[answered] = responseVal;
+  }
+
+  Json::Value responseVal = responses_[id];
+  responses_.erase(id);
+
+  std::lock_guard<std::mutex> lock(sendMutex_);
+  unreceived_--;
+  return responseVal;
+}
+
+
+
+// reads the next response from the socket and sets the id of the request it
+// answers, which is the oldest outstanding one if the server gave no id
+Json::Value TorStream::readResponse(uint32_t& id)
+{
+  // read from socket until newline, leaving anything after it in buffer_
+  boost::asio::read_until(*socket_, buffer_, "\n");
+  std::istream is(&buffer_);
+  std::string responseStr;
+  std::getline(is, responseStr);
+
+  // parse into JSON object
+  Json::Reader reader;
+  Json::Value responseVal;
+  if (!reader.parse(responseStr, responseVal))
+    responseVal["error"] = "Failed to parse response from server.";
+
+  if (!responseVal.isMember("type") || !responseVal.isMember("value"))
+    responseVal["error"] = "Invalid response from server.";
+
+  std::lock_guard<std::mutex> lock(sendMutex_);
+  auto iter = outstanding_.begin();
+  if (responseVal.isObject() && responseVal["id"].isUInt())
+    iter = std::find(outstanding_.begin(), outstanding_.end(),
+                     responseVal["id"].asUInt());
+  if (iter == outstanding_.end())
+    Log::get().error("Response from server matches no outstanding request.");
+
+  id = *iter;
+  outstanding_.erase(iter);
+  return responseVal;
+}
@@ -4,15 +4,24 @@
 
 #include "socks5/Socks5.hpp"
 #include <json/json.h>
+#include <mutex>
+#include <deque>
+#include <map>
 #include <string>
 
 typedef std::shared_ptr<boost::asio::ip::tcp::socket> SocketPtr;
 
+// One circuit to a remote host, kept open across queries. Each request is
+// tagged with an id that the server echoes, so several can be outstanding at
+// once and their responses may arrive in any order; a response without an id
+// answers the oldest outstanding request.
 class TorStream
 {
  public:
   TorStream(const std::string&, ushort, const std::string&, ushort);
   virtual ~TorStream() {}
+  uint32_t send(const std::string&, const std::string&);
+  virtual Json::Value receive(uint32_t);
   virtual Json::Value sendReceive(const std::string&, const std::string&);
   SocketPtr getSocket() const;
   boost::asio::io_service& getIO();
@@ -20,6 +29,8 @@ class TorStream
  private:
   bool confirmProtocol();
   void waitUntilReady() const;
+  Json::Value takeResponse(uint32_t);
+  Json::Value readResponse(uint32_t&);
 
   static void initCallback(Socks5::Error,
                            boost::system::error_code,
@@ -30,6 +41,26 @@ class TorStream
   SocketPtr socket_;
   std::shared_ptr<Socks5::Socks5> socks_;
   bool ready_;
+
+  // the SYN is pipelined ahead of the first query, and its response is
+  // checked by the first receive
+  uint32_t synId_;
+  bool confirmed_;
+
+  // guards writes, nextId_, outstanding_, and unreceived_
+  std::mutex sendMutex_;
+  uint32_t nextId_;
+  std::deque<uint32_t> outstanding_;  // in the order they were sent
+  size_t unreceived_;                 // sent but not yet taken by receive()
+
+  // guards reads, confirmed_, buffer_, and responses_
+  std::mutex receiveMutex_;
+  boost::asio::streambuf buffer_;              // may hold later responses
+  std::map<uint32_t, Json::Value> responses_;  // arrived but not yet taken
+
+  // send() refuses more requests than this awaiting receive(), which bounds
+  // the responses set aside without discarding any
+  static const size_t MAX_UNRECEIVED = 256;
 };
 
 #endif